@@ -14,32 +14,187 @@
 #include <h9def.h>
 
 #include "avr/can.h"
+#include "avr/can_bittiming.h"
+#include "avr/persist.h"
+#include "avr/h9boot.h"
 
-#define CAN_RX_BUF_SIZE 16
-#define CAN_RX_BUF_INDEX_MASK 0x0F
+// ring sizes in bytes, set per mmcu in cmake/avr_alt_setting.cmake
+#ifndef CAN_RX_BUF_SIZE
+#define CAN_RX_BUF_SIZE 256
+#endif
+#define CAN_RX_BUF_INDEX_MASK (CAN_RX_BUF_SIZE - 1)
+
+#ifndef CAN_TX_BUF_SIZE
+#define CAN_TX_BUF_SIZE 64
+#endif
+#define CAN_TX_BUF_INDEX_MASK (CAN_TX_BUF_SIZE - 1)
+
+#if CAN_RX_BUF_SIZE < 16 || CAN_RX_BUF_SIZE > 256 || (CAN_RX_BUF_SIZE & CAN_RX_BUF_INDEX_MASK)
+#error "CAN_RX_BUF_SIZE must be a power of two from 16 to 256"
+#endif
+#if CAN_TX_BUF_SIZE < 16 || CAN_TX_BUF_SIZE > 256 || (CAN_TX_BUF_SIZE & CAN_TX_BUF_INDEX_MASK)
+#error "CAN_TX_BUF_SIZE must be a power of two from 16 to 256"
+#endif
+
+/*
+ * The rings are byte-packed: a frame takes the header (cancdmob, canidt1..4) and only its payload bytes,
+ * it may wrap around the end of the ring. One byte always stays free to tell a full ring from an empty one.
+ */
+#define CAN_BUF_HEADER_SIZE 5
+#define CAN_BUF_PAYLOAD(cancdmob) (((cancdmob) & 0x0f) > 8 ? 8 : ((cancdmob) & 0x0f))
+
+// MOb0 always transmits, MOb3-5 too until CAN_set_mob_for_remote_node1..3 or CAN_subscribe takes them for rx
+#define CAN_TX_MOB_POOL ((1 << 0) | (1 << 3) | (1 << 4) | (1 << 5))
+#define CAN_REMOTE_MOB_FIRST 3
+#define CAN_REMOTE_MOB_COUNT 3
 
-#define CAN_TX_BUF_SIZE 8
-#define CAN_TX_BUF_INDEX_MASK 0x07
+/*
+ * The rings are single producer/single consumer: the producer owns the slot at top until it moves
+ * top, the consumer owns the slot at bottom until it moves bottom. The indexes are single bytes,
+ * the barrier keeps the slot access on the right side of the index update.
+ */
+#ifndef CAN_BARRIER // the host bench takes the CAN interrupt here to test the index updates
+#define CAN_BARRIER() __asm__ __volatile__ ("" ::: "memory")
+#endif
 
 #define STR_HELPER(x) #x
 #define STR(x) STR_HELPER(x)
 
-typedef struct {
-    uint8_t canidt1;
-    uint8_t canidt2;
-    uint8_t canidt3;
-    uint8_t canidt4;
-    uint8_t cancdmob;
-    uint8_t data[8];
-} can_buf_t;
-
-static can_buf_t can_rx_buf[CAN_RX_BUF_SIZE];
+static uint8_t can_rx_buf[CAN_RX_BUF_SIZE];
 static volatile uint8_t can_rx_buf_top = 0;
 static volatile uint8_t can_rx_buf_bottom = 0;
 
-static can_buf_t can_tx_buf[CAN_TX_BUF_SIZE];
-static volatile uint8_t can_tx_buf_top = 0;
-static volatile uint8_t can_tx_buf_bottom = 0;
+// one queue per priority, indexed by H9MSG_PRIORITY_HIGH/H9MSG_PRIORITY_LOW
+static uint8_t can_tx_buf[2][CAN_TX_BUF_SIZE];
+static volatile uint8_t can_tx_buf_top[2];
+static volatile uint8_t can_tx_buf_bottom[2];
+static volatile uint8_t can_tx_mobs = CAN_TX_MOB_POOL;
+static volatile uint8_t can_tx_high_mobs;
+
+// the CAN interrupt updates the rx/tx/error counters, CAN_put_msg the tx ones
+static can_stats_t can_stats;
+#define CAN_STAT_INC(counter) do { if ((counter) != UINT16_MAX) ++(counter); } while (0)
+// NODE_CAN_STATS_STD_REGISTER and NODE_CAN_ERRORS_STD_REGISTER, layout in h9def.h
+#define CAN_STATS_REG_SIZE 7
+#define CAN_ERRORS_REG_SIZE 11
+#define CAN_STATS_SATURATE(counter) ((counter) > 0xff ? 0xff : (counter))
+
+/*
+ * Bus off stops the busy tx MObs, their frames stay in the MObs. The controller rejoins the bus by itself, the tx
+ * MObs wait CAN_BUS_OFF_BACKOFF_MIN CAN timer overflows (32 ms at 16 MHz) more, twice as long after each next bus
+ * off without a frame sent, up to CAN_BUS_OFF_BACKOFF_MAX. After CAN_BUS_OFF_REQUEUE_LIMIT bus offs in a row
+ * the stopped frames are dropped instead. A tx MOb with CAN_TX_MOB_ERROR_LIMIT errors in a row (error passive,
+ * nobody acknowledges) gives its frame up too.
+ */
+#define CAN_BUS_OFF_BACKOFF_MIN 2
+#define CAN_BUS_OFF_BACKOFF_MAX 64
+#define CAN_BUS_OFF_REQUEUE_LIMIT 3
+#define CAN_TX_MOB_ERROR_LIMIT 64
+// CAN timer overflows in bus off past the backoff before the controller is reset
+#define CAN_BUS_OFF_RESTART_TICKS 32
+
+// the CAN interrupt owns the recovery state, the tx path only reads bus_off_hold
+static volatile uint8_t bus_off_hold; // CAN timer overflows left, 0 - the tx MObs may send
+static uint8_t bus_off_backoff = CAN_BUS_OFF_BACKOFF_MIN;
+static uint8_t bus_off_in_row;
+static uint8_t bus_off_stuck; // overflows held past the backoff
+static uint8_t requeue_mobs;
+static uint8_t requeue_cdmob[6];
+static uint8_t tx_mob_errors[6];
+
+static can_frame_handler_t frame_handler;
+// bytes of the CAN_reserve_* frame at the top of a tx queue, nothing else goes there until CAN_commit_msg
+static volatile uint8_t tx_reserved[2];
+static const can_reg_t *reg_table;
+static uint8_t reg_count;
+
+// registers longer than this go in segments
+#define CAN_REG_FRAME_VALUE_SIZE 7
+
+// the segmented value being sent, CAN_get_msg/CAN_dispatch feed the tx queue with it
+static struct {
+    h9msg_t msg;
+    uint8_t value[H9MSG_MAX_REGISTER_SIZE];
+    uint8_t length;
+    uint8_t offset;
+    uint8_t segment;
+} tx_segments;
+
+// the batched GET_REG being answered
+static struct {
+    h9msg_t req;
+    uint8_t next;
+} tx_batch;
+
+// the segmented SET_REG value being received
+static struct {
+    uint16_t source_id;
+    uint8_t seqnum;
+    uint8_t reg;
+    uint8_t segment;
+    uint8_t length;
+    uint8_t value[H9MSG_MAX_REGISTER_SIZE];
+} rx_segments;
+static uint8_t next_seqnum;
+
+// frames of a bulk stream not acknowledged yet, at most
+#define CAN_BULK_WINDOW_MAX 32
+// full frames the rx ring holds, two left for the other traffic
+#define CAN_BULK_RX_WINDOW (CAN_RX_BUF_SIZE / (CAN_BUF_HEADER_SIZE + 8) > 3 ? CAN_RX_BUF_SIZE / (CAN_BUF_HEADER_SIZE + 8) - 2 : 1)
+// low priority tx queue bytes a stream leaves to the other frames
+#define CAN_BULK_TX_RESERVE (2 * (CAN_BUF_HEADER_SIZE + 8))
+// CAN timer overflows without an acknowledgement before the sender goes back
+#define CAN_BULK_TIMEOUT 4
+// timeouts in a row before the sender gives the stream up, the receiver is gone
+#define CAN_BULK_RETRIES 8
+
+static volatile uint8_t can_ticks; // CAN timer overflows while ENOVRT is on
+
+// the outgoing bulk stream, the buffer holds count bytes from head: the acknowledged ones leave it
+static struct {
+    uint8_t *buf;
+    uint16_t size;
+    uint16_t head;
+    uint16_t count;
+    uint16_t sent; // bytes before the frame next
+    uint16_t cut;  // bytes before the frame top
+    uint16_t destination_id;
+    uint8_t state;
+    uint8_t control; // H9MSG_BULK_* to send, 0 - none
+    uint8_t polled;
+    uint8_t base;    // the first frame not acknowledged
+    uint8_t next;    // the next frame to send
+    uint8_t top;     // the first frame not cut from the buffer yet
+    uint8_t window;
+    uint8_t tick;    // can_ticks of the last progress
+    uint8_t retries; // timeouts since then
+    uint8_t frame_length[CAN_BULK_WINDOW_MAX]; // a resent frame keeps its bytes
+} bulk_tx;
+
+// the incoming bulk stream
+static struct {
+    can_bulk_handler_t handler;
+    uint16_t source_id; // H9MSG_BROADCAST_ID - none
+    uint8_t expected;
+    uint8_t unacked;
+    uint8_t resend;  // RESEND sent for the current gap
+    uint8_t control; // H9MSG_BULK_CREDIT or H9MSG_BULK_RESEND to send, 0 - none
+} bulk_rx = {.source_id = H9MSG_BROADCAST_ID};
+
+// CAN_subscribe list, checked in software only when the filters accept more than it
+static const can_subscription_t *subscriptions;
+static uint8_t subscription_count;
+
+// acceptance filter over the source id and the type
+typedef struct {
+    uint16_t source_id;
+    uint16_t source_mask;
+    uint8_t type;
+    uint8_t type_mask;
+} can_filter_t;
+
+// the filters of the MOb3-5 out of the tx pool, for a controller restart
+static can_filter_t remote_filters[CAN_REMOTE_MOB_COUNT];
 
 volatile uint16_t can_node_id;
 static uint8_t reset_reason __attribute__ ((section (".noinit")));
@@ -61,6 +216,48 @@ static uint8_t calc_can_id3(uint8_t priority, uint8_t type, uint8_t seqnum, uint
 static uint8_t calc_can_id4(uint8_t priority, uint8_t type, uint8_t seqnum, uint16_t destination_id, uint16_t source_id);
 static void set_CAN_id(uint8_t priority, uint8_t type, uint8_t seqnum, uint16_t destination_id, uint16_t source_id);
 static void set_CAN_id_mask(uint8_t priority, uint8_t type, uint8_t seqnum, uint16_t destination_id, uint16_t source_id);
+static int8_t next_tx_mob(uint8_t priority);
+static uint8_t can_int_mask(void);
+static void can_int_restore(uint8_t cangie);
+static void start_controller(void);
+static void load_tx_queue(void);
+static void unload_tx_mob(uint8_t mob);
+static void count_errors(uint8_t flags);
+static void bus_off(void);
+static void bus_off_tick(void);
+static void set_rx_filter(uint8_t mob, const can_filter_t *filter);
+static void write_rx_filter(uint8_t mob, const can_filter_t *filter);
+static void release_rx_mob(uint8_t mob);
+static void subscription_filter(const can_subscription_t *subscription, can_filter_t *filter);
+static void merge_filters(const can_filter_t *a, const can_filter_t *b, can_filter_t *merged);
+static uint16_t filter_types(const can_filter_t *filter, uint16_t source_id);
+static uint16_t filter_size(const can_filter_t *filter);
+static uint8_t remote_subscribed(uint16_t source_id, uint8_t type);
+static uint8_t stats_reg_value(uint8_t reg, uint8_t *value);
+static uint8_t response_type(uint8_t request_type);
+static uint8_t process_reg_msg(h9msg_t *cm);
+static uint8_t read_reg_desc(uint8_t reg, can_reg_t *desc);
+static void read_reg(uint8_t reg, const can_reg_t *desc, uint8_t *value);
+static uint8_t write_reg(uint8_t reg, const can_reg_t *desc, const uint8_t *value);
+static uint8_t frame_kind(const can_frame_t *frame);
+static uint8_t rx_byte(const can_frame_t *frame, uint8_t offset);
+static uint8_t tx_space(uint8_t priority);
+static uint8_t tx_free(uint8_t priority);
+static uint8_t tx_room(uint8_t priority, uint8_t dlc);
+static uint8_t reserve_tx(uint8_t priority, uint8_t dlc);
+static void put_value(h9msg_t *res, const uint8_t *value, uint8_t length, uint8_t segmented);
+static void put_tx_segments(void);
+static uint8_t get_reg(h9msg_t *cm);
+static void put_tx_batch(void);
+static uint8_t get_rx_segment(const h9msg_t *cm, const can_reg_t *desc);
+static uint8_t write_tx_header(uint8_t priority, uint8_t top, uint8_t type, uint8_t seqnum, uint16_t destination_id, uint16_t source_id, uint8_t dlc);
+static uint8_t publish_tx(uint8_t priority, uint8_t top);
+static uint8_t bulk_seq_diff(uint8_t a, uint8_t b);
+static uint8_t bulk_seq_add(uint8_t seq, uint8_t n);
+static uint8_t put_bulk_control(uint16_t destination_id, uint8_t op, uint8_t seq, uint8_t window, uint8_t dlc);
+static void bulk_msg(const h9msg_t *cm);
+static void bulk_credit(uint8_t op, uint8_t ack, uint8_t window);
+static void bulk_pump(void);
 
 /* for software reset */
 __attribute__((naked)) __attribute__((section(".init3"))) void wdt_init(void) {
@@ -81,49 +278,93 @@ ISR(CANIT_vect) {
 #else
 ISR(CAN_INT_vect) {
 #endif
-    uint8_t canhpmob = CANHPMOB;
     uint8_t cangit = CANGIT;
-    if (canhpmob != 0xf0) {
-        uint8_t savecanpage = CANPAGE;
+    uint8_t savecanpage = CANPAGE;
+    uint8_t top = can_rx_buf_top;
+    uint8_t tx_done = 0;
+    uint8_t canhpmob;
+    // all pending MObs in one entry, the received frames go to consecutive slots
+    while ((canhpmob = CANHPMOB) != 0xf0) {
         CANPAGE = canhpmob;
-        if (CANSTMOB & (1 << RXOK)) {
-            can_rx_buf[can_rx_buf_top].canidt1 = CANIDT1;
-            can_rx_buf[can_rx_buf_top].canidt2 = CANIDT2;
-            can_rx_buf[can_rx_buf_top].canidt3 = CANIDT3;
-            can_rx_buf[can_rx_buf_top].canidt4 = CANIDT4;
-            can_rx_buf[can_rx_buf_top].cancdmob = CANCDMOB & 0x1f;
-            for (uint8_t i = 0; i < 8; ++i) {
-                can_rx_buf[can_rx_buf_top].data[i] = CANMSG;
+        uint8_t canstmob = CANSTMOB;
+        if (canstmob & (1 << RXOK)) {
+            uint8_t cancdmob = CANCDMOB & 0x1f;
+            uint8_t length = CAN_BUF_HEADER_SIZE + CAN_BUF_PAYLOAD(cancdmob);
+            uint8_t bottom = can_rx_buf_bottom;
+            CAN_STAT_INC(can_stats.rx_frames);
+            if ((uint8_t)((bottom - top - 1) & CAN_RX_BUF_INDEX_MASK) < length) { // full ring drops the new frame
+                CAN_STAT_INC(can_stats.rx_overruns);
+            }
+            else {
+                can_rx_buf[top] = cancdmob;
+                top = (uint8_t)((top + 1) & CAN_RX_BUF_INDEX_MASK);
+                can_rx_buf[top] = CANIDT1;
+                top = (uint8_t)((top + 1) & CAN_RX_BUF_INDEX_MASK);
+                can_rx_buf[top] = CANIDT2;
+                top = (uint8_t)((top + 1) & CAN_RX_BUF_INDEX_MASK);
+                can_rx_buf[top] = CANIDT3;
+                top = (uint8_t)((top + 1) & CAN_RX_BUF_INDEX_MASK);
+                can_rx_buf[top] = CANIDT4;
+                top = (uint8_t)((top + 1) & CAN_RX_BUF_INDEX_MASK);
+                for (uint8_t i = CAN_BUF_HEADER_SIZE; i < length; ++i) {
+                    can_rx_buf[top] = CANMSG;
+                    top = (uint8_t)((top + 1) & CAN_RX_BUF_INDEX_MASK);
+                }
+                uint8_t used = (uint8_t)((top - bottom) & CAN_RX_BUF_INDEX_MASK);
+                if (used > can_stats.rx_high_water)
+                    can_stats.rx_high_water = used;
             }
-            can_rx_buf_top = (uint8_t)((can_rx_buf_top + 1) & CAN_RX_BUF_INDEX_MASK);
             CANCDMOB = (1<<CONMOB1) | (1<<IDE); //rx mob
             CANSTMOB = 0x00;  // Reset reason on selected channel
         }
-        else if (CANSTMOB & (1 << TXOK)) {
-            CANCDMOB = 0; //disable mob
+        else if (canstmob & (1 << TXOK)) {
             CANSTMOB = 0x00;  // Reset reason on selected channel
-            if (can_tx_buf_top != can_tx_buf_bottom) {
-                CANIDT1 = can_tx_buf[can_tx_buf_bottom].canidt1;
-                CANIDT2 = can_tx_buf[can_tx_buf_bottom].canidt2;
-                CANIDT3 = can_tx_buf[can_tx_buf_bottom].canidt3;
-                CANIDT4 = can_tx_buf[can_tx_buf_bottom].canidt4;
-
-                uint8_t idx = 0;
-                for (; idx < 8; ++idx)
-                    CANMSG = can_tx_buf[can_tx_buf_bottom].data[idx];
-
-                CANCDMOB = (1 << CONMOB0) | (1 << IDE) | (can_tx_buf[can_tx_buf_bottom].cancdmob & 0x0f);
-
-                can_tx_buf_bottom = (uint8_t)((can_tx_buf_bottom + 1) & CAN_TX_BUF_INDEX_MASK);
-            }
+            if (!(can_tx_mobs & (1 << (canhpmob >> 4))))
+                continue; // aborted by set_rx_filter while on the bus, the MOb receives now
+            CANCDMOB = 0; //disable mob
+            tx_done = 1;
+            CAN_STAT_INC(can_stats.tx_frames);
+            tx_mob_errors[canhpmob >> 4] = 0;
+            bus_off_in_row = 0;
+            bus_off_backoff = CAN_BUS_OFF_BACKOFF_MIN;
         }
         else {
+            uint8_t errors = canstmob & ((1 << BERR) | (1 << SERR) | (1 << CERR) | (1 << FERR) | (1 << AERR));
+            if (errors) {
+                CAN_STAT_INC(can_stats.error_interrupts);
+                count_errors(errors);
+            }
             CANSTMOB = 0x00;  // Reset reason on selected channel
+            uint8_t mob = canhpmob >> 4;
+            if (errors && (can_tx_mobs & (1 << mob)) && (CANCDMOB & (1 << CONMOB0))
+                && ++tx_mob_errors[mob] >= CAN_TX_MOB_ERROR_LIMIT) {
+                CANCDMOB = 0; // stuck, the controller would retry it forever
+                tx_mob_errors[mob] = 0;
+                CAN_STAT_INC(can_stats.tx_drops);
+                // the MOb may stay busy till the error frame ends, the next timer overflow retries the queue
+                CANGIE |= 1 << ENOVRT;
+                tx_done = 1;
+            }
         }
-        CANPAGE = savecanpage;
     }
-    //other interrupt
-    CANGIT |= (cangit & 0x7f);
+    CAN_BARRIER();
+    can_rx_buf_top = top;
+    if (cangit & ((1 << BOFFIT) | (1 << SERG) | (1 << CERG) | (1 << FERG) | (1 << AERG))) {
+        CAN_STAT_INC(can_stats.error_interrupts);
+        count_errors(cangit & ((1 << SERG) | (1 << CERG) | (1 << FERG) | (1 << AERG)));
+    }
+    if (cangit & (1 << BOFFIT))
+        bus_off();
+    else if ((cangit & (1 << OVRTIM)) && (CANGIE & (1 << ENOVRT))) {
+        ++can_ticks;
+        bus_off_tick();
+    }
+    if (tx_done) {
+        load_tx_queue();
+    }
+    CANPAGE = savecanpage;
+    // write one to clear, only the flags handled above
+    CANGIT = cangit & 0x7f;
 }
 
 
@@ -146,6 +387,7 @@ uint8_t process_msg(h9msg_t *cm) {
             return 0;
         }
         else if (cm->type == H9MSG_TYPE_NODE_RESET && cm->dlc == 0) {
+            PERSIST_flush();
             cli();
             do {
                 wdt_enable(WDTO_15MS);
@@ -156,8 +398,8 @@ uint8_t process_msg(h9msg_t *cm) {
     }
     else if ((cm->type & H9MSG_NODE_STANDARD_MSG_GROUP_MASK) == H9MSG_NODE_STANDARD_MSG_GROUP && cm->destination_id == can_node_id) {
         if (cm->type == H9MSG_TYPE_SET_REG && cm->dlc > 1) {
-            if (cm->data[0] >= 10)
-                return 1;
+            if (cm->data[0] >= CAN_FIRST_APP_REGISTER)
+                return process_reg_msg(cm);
             h9msg_t cm_res;
             CAN_init_response_msg(cm, &cm_res);
             cm_res.dlc = 2;
@@ -172,131 +414,97 @@ uint8_t process_msg(h9msg_t *cm) {
                 }
                 else {
                     cm_res.type = H9MSG_TYPE_ERROR;
-                    cm_res.data[0] = H9MSG_ERROR_REGISTER_SIZE_MISMATCH;
+                    cm_res.data[0] = H9FRAME_ERROR_REGISTER_SIZE_MISMATCH;
+                    cm_res.dlc = 1;
+                }
+            }
+            else if (cm_res.data[0] == NODE_CAN_STATS_STD_REGISTER || cm_res.data[0] == NODE_CAN_ERRORS_STD_REGISTER) {
+                if (cm->dlc == 2) {
+                    CAN_clear_stats();
+                    uint8_t value[CAN_ERRORS_REG_SIZE];
+                    uint8_t length = stats_reg_value(cm_res.data[0], value);
+                    put_value(&cm_res, value, length, length > 7);
+                    return 0;
+                }
+                else {
+                    cm_res.type = H9MSG_TYPE_ERROR;
+                    cm_res.data[0] = H9FRAME_ERROR_REGISTER_SIZE_MISMATCH;
                     cm_res.dlc = 1;
                 }
             }
             else if (cm_res.data[0] < NODE_STD_REGISTER_LAST) {
                 cm_res.type = H9MSG_TYPE_ERROR;
-                cm_res.data[0] = H9MSG_ERROR_READ_ONLY_REGISTER;
+                cm_res.data[0] = H9FRAME_ERROR_READ_ONLY_REGISTER;
                 cm_res.dlc = 1;
             }
             else {
                 cm_res.type = H9MSG_TYPE_ERROR;
-                cm_res.data[0] = H9MSG_ERROR_INVALID_REGISTER;
+                cm_res.data[0] = H9FRAME_ERROR_INVALID_REGISTER;
                 cm_res.dlc = 1;
             }
             CAN_put_msg(&cm_res);
             return 0;
         }
         else if (cm->type == H9MSG_TYPE_GET_REG && cm->dlc == 1) {
-            if (cm->data[0] >= 10)
-                return 1;
-            h9msg_t cm_res;
-            CAN_init_response_msg(cm, &cm_res);
-            cm_res.dlc = 2;
-            cm_res.data[0] = cm->data[0];
-            switch (cm_res.data[0]) {
-                case NODE_TYPE_STD_REGISTER:
-                    cm_res.data[1] = (node_info.node_type >> 8) & 0xff;
-                    cm_res.data[2] = (node_info.node_type ) & 0xff;
-                    cm_res.dlc = 3;
-                    break;
-                case NODE_HARDWARE_REVISION_STD_REGISTER:
-                    cm_res.data[1] = 'a';
-                    cm_res.dlc = 2;
-                    break;
-                case NODE_VERSION_STD_REGISTER:
-                    cm_res.data[1] = (node_info.version_major >> 8);
-                    cm_res.data[2] = node_info.version_major & 0xff;
-                    cm_res.data[3] = (node_info.version_minor >> 8) & 0xff;
-                    cm_res.data[4] = node_info.version_minor & 0xff;
-                    cm_res.dlc = 5;
-                    break;
-                case NODE_BUILD_INFO_STD_REGISTER:
-                //TODO: add multi-message value with message counter on 7 byte
-                    cm_res.dlc = 7;
-                    char *tmp = node_info.build_info;
-                    uint8_t i = 0;
-                    for (; tmp[i] && i < 6; ++i) {
-                        cm_res.data[1 + i] = tmp[i];
-                    }
-                    for (; i < 6; ++i) {
-                        cm_res.data[1 + i] = '\0';
-                    }
-                    break;
-                case NODE_ID_STD_REGISTER:
-                    cm_res.data[1] = (can_node_id >> 8) & 0x01;
-                    cm_res.data[2] = (can_node_id) & 0xff;
-                    cm_res.dlc = 3;
-                    break;
-                case NODE_MCU_TYPE_STD_REGISTER:
-#if defined (__AVR_ATmega16M1__)
-                    cm_res.data[1] = NODE_MCU_ATMEGA16M1;
-#elif defined (__AVR_ATmega32M1__)
-                    cm_res.data[1] = NODE_MCU_ATMEGA32M1;
-#elif defined (__AVR_ATmega64M1__)
-                    cm_res.data[1] = NODE_MCU_ATMEGA64M1;
-#elif defined (__AVR_AT90CAN128__)
-                    cm_res.data[1] = NODE_MCU_AT90CAN128;
-#elif defined (__AVR_ATmega32C1__)
-                    cm_res.data[2] = NODE_MCU_ATMEGA32C1;
-#else
-#error Unsupported MCU
-#endif
-                    cm_res.dlc = 2;
-                    break;
-                case NODE_SN_STD_REGISTER: //CPU serial ID
-                    cm_res.data[1] = 0;
-                    cm_res.data[2] = 0;
-                    cm_res.data[3] = 0;
-                    cm_res.data[4] = 0;
-                    cm_res.dlc = 5;
-                case NODE_RESET_REASON_STD_REGISTER:
-                    cm_res.data[1] = reset_reason;
-                    cm_res.dlc = 2;
-                    break;
-                default:
-                    cm_res.type = H9MSG_TYPE_ERROR;
-                    cm_res.data[0] = H9MSG_ERROR_INVALID_REGISTER;
-                    cm_res.dlc = 1;
+            return get_reg(cm);
+        }
+        else if (cm->type == H9MSG_TYPE_GET_REG && cm->dlc > 1) {
+            if (tx_batch.next < tx_batch.req.dlc) { // one batch at a time, the requester asks again
+                h9msg_t cm_res;
+                CAN_init_response_msg(cm, &cm_res);
+                cm_res.type = H9MSG_TYPE_ERROR;
+                cm_res.data[0] = H9FRAME_ERROR_BUSY;
+                cm_res.dlc = 1;
+                CAN_put_msg(&cm_res);
+                return 0;
             }
-            CAN_put_msg(&cm_res);
+            tx_batch.req = *cm;
+            if (tx_batch.req.dlc > 8)
+                tx_batch.req.dlc = 8;
+            tx_batch.next = 0;
+            put_tx_batch();
             return 0;
         }
         else if (cm->type == H9MSG_TYPE_NODE_UPGRADE && cm->dlc == 0) {
 #ifdef BOOTSTART
+            PERSIST_flush();
             cli();
+            *H9BOOT_UPGRADE_REQUEST = H9BOOT_UPGRADE_MAGIC;
             asm volatile ( "jmp " STR(BOOTSTART) );
 #else
             #warning "Node upgrade (bootloader) disable"
             h9msg_t cm_res;
             CAN_init_response_msg(cm, &cm_res);
             cm_res.type = H9MSG_TYPE_ERROR;
-            cm_res.data[0] = H9MSG_ERROR_BOOTLOADER_UNSUPPORTED;
+            cm_res.data[0] = H9FRAME_ERROR_BOOTLOADER_UNSUPPORTED;
             cm_res.dlc = 1;
             CAN_put_msg(&cm_res);
             return 0;
 #endif //BOOTSTART
         }
         else if (cm->type == H9MSG_TYPE_SET_BIT && cm->dlc == 2) {
-            return 1;
+            return process_reg_msg(cm);
         }
         else if (cm->type == H9MSG_TYPE_CLEAR_BIT && cm->dlc == 2) {
-            return 1;
+            return process_reg_msg(cm);
         }
         else if (cm->type == H9MSG_TYPE_TOGGLE_BIT && cm->dlc == 2) {
-            return 1;
+            return process_reg_msg(cm);
         }
     }
+    else if ((cm->type & H9MSG_NODE_SPECIFIC_BULK_MSG_GROUP_MASK) == H9MSG_NODE_SPECIFIC_BULK_MSG_GROUP
+             && cm->destination_id == can_node_id) {
+        bulk_msg(cm);
+        return 0;
+    }
     else if ((cm->type & H9MSG_NODE_ALL_REMOTE_MSG_GROUP_MASK) == H9MSG_NODE_ALL_REMOTE_MSG_GROUP) {
-        return 2;
+        return remote_subscribed(cm->source_id, cm->type) ? 2 : 0;
     }
 
     h9msg_t cm_res;
     CAN_init_response_msg(cm, &cm_res);
     cm_res.type = H9MSG_TYPE_ERROR;
-    cm_res.data[0] = H9MSG_ERROR_INVALID_MSG;
+    cm_res.data[0] = H9FRAME_ERROR_INVALID_MSG;
     cm_res.dlc = 1;
     CAN_put_msg(&cm_res);
     return 0;
@@ -311,25 +519,34 @@ void CAN_init(uint16_t node_type, char hardware_rev, uint16_t version_major, uin
     strncpy(node_info.build_info, build_info, H9MSG_MAX_REGISTER_SIZE);
 
     read_node_id();
+    // for the bootloader multicast session join
+    PERSIST_write_word(H9BOOT_EE_NODE_TYPE, node_type);
+
+    can_tx_mobs = CAN_TX_MOB_POOL;
+    bus_off_hold = 0;
+    bus_off_backoff = CAN_BUS_OFF_BACKOFF_MIN;
+    bus_off_in_row = 0;
+    bus_off_stuck = 0;
+    requeue_mobs = 0;
+    tx_reserved[H9MSG_PRIORITY_HIGH] = 0;
+    tx_reserved[H9MSG_PRIORITY_LOW] = 0;
+    bulk_tx.state = CAN_BULK_CLOSED;
+    bulk_rx.source_id = H9MSG_BROADCAST_ID;
+    bulk_rx.control = 0;
+
+    start_controller();
+}
 
+
+// the controller from reset on, the MObs as the driver state says
+void start_controller(void) {
     CANGCON = ( 1 << SWRES );   // Software reset
     CANTCON = 0x00;             // CAN timing prescaler set to 0;
 
-#if F_CPU == 4000000UL
-    CANBT1 = 0x06;
-    CANBT2 = 0x04;
-    CANBT3 = 0x13;
-#elif F_CPU == 12000000UL
-    CANBT1 = 0x16;
-    CANBT2 = 0x04;
-    CANBT3 = 0x13;
-#elif F_CPU == 16000000UL
-    CANBT1 = 0x1e;
-    CANBT2 = 0x04;
-    CANBT3 = 0x13;
-#else
-#error "Please specify F_CPU"
-#endif
+    // CAN_BITRATE and CAN_SAMPLE_POINT, see avr/can_bittiming.h
+    CANBT1 = CAN_BT1_VALUE;
+    CANBT2 = CAN_BT2_VALUE;
+    CANBT3 = CAN_BT3_VALUE;
 
     for ( int8_t mob=0; mob<6; mob++ ) {
         CANPAGE = ( mob << MOBNB0 ); // Selects Message Object 0-5
@@ -344,21 +561,280 @@ void CAN_init(uint16_t node_type, char hardware_rev, uint16_t version_major, uin
     CANIDM4 |= 1 << IDEMSK; // set filter
     CANCDMOB = (1<<CONMOB1) | (1<<IDE); //rx mob, 29-bit only
 
-    //select mob 2 for unicast
+    //select mob 2 for unicast, the standard group and the bulk types (type bit 3 set in both)
     CANPAGE = 0x02 << MOBNB0;
     set_CAN_id(0, H9MSG_NODE_STANDARD_MSG_GROUP, 0, can_node_id, 0);
-    set_CAN_id_mask(0, H9MSG_NODE_STANDARD_MSG_GROUP_MASK, 0, (1<<H9MSG_ID_BIT_LENGTH)-1, 0); //H9MSG_TYPE_GROUP_2 | H9MSG_TYPE_GROUP_3
+    set_CAN_id_mask(0, H9MSG_NODE_STANDARD_MSG_GROUP & H9MSG_NODE_SPECIFIC_BULK_MSG_GROUP, 0, (1<<H9MSG_ID_BIT_LENGTH)-1, 0);
     CANIDM4 |= 1 << IDEMSK; // set filter
     CANCDMOB = (1<<CONMOB1) | (1<<IDE); //rx mob, 29-bit only
 
+    CANIE2 = ( 1 << IEMOB0 ) | ( 1 << IEMOB1 ) | ( 1 << IEMOB2 ) | ( 1 << IEMOB3 ) | ( 1 << IEMOB4 ) | ( 1 << IEMOB5 ); //interupt all mobs
 
-    CANIE2 = ( 1 << IEMOB0 ) | ( 1 << IEMOB1 ) | ( 1 << IEMOB2 ); //interupt mob 0 1 and 2
+    // the remote node filters CAN_subscribe or CAN_set_mob_for_remote_node1..3 set
+    for (uint8_t mob = CAN_REMOTE_MOB_FIRST; mob < CAN_REMOTE_MOB_FIRST + CAN_REMOTE_MOB_COUNT; ++mob) {
+        if (!(can_tx_mobs & (1 << mob)))
+            write_rx_filter(mob, &remote_filters[mob - CAN_REMOTE_MOB_FIRST]);
+    }
 
-    CANGIE = (1<<ENBOFF) | (1<<ENIT) | (1<<ENRX) | (1<<ENTX) | (1<<ENERR) | (1<<ENBX) | (1<<ENERG);
+    CANGIE = (1<<ENBOFF) | (1<<ENIT) | (1<<ENRX) | (1<<ENTX) | (1<<ENERR) | (1<<ENBX) | (1<<ENERG)
+             | (bulk_tx.state != CAN_BULK_CLOSED ? 1<<ENOVRT : 0);
     CANGCON = 1<<ENASTB;
 }
 
 
+// GET_REG of the single register data[0]
+uint8_t get_reg(h9msg_t *cm) {
+    if (cm->data[0] >= CAN_FIRST_APP_REGISTER)
+        return process_reg_msg(cm);
+    h9msg_t cm_res;
+    CAN_init_response_msg(cm, &cm_res);
+    cm_res.dlc = 2;
+    cm_res.data[0] = cm->data[0];
+    switch (cm_res.data[0]) {
+        case NODE_TYPE_STD_REGISTER:
+            cm_res.data[1] = (node_info.node_type >> 8) & 0xff;
+            cm_res.data[2] = (node_info.node_type ) & 0xff;
+            cm_res.dlc = 3;
+            break;
+        case NODE_HARDWARE_REVISION_STD_REGISTER:
+            cm_res.data[1] = 'a';
+            cm_res.dlc = 2;
+            break;
+        case NODE_VERSION_STD_REGISTER:
+            cm_res.data[1] = (node_info.version_major >> 8);
+            cm_res.data[2] = node_info.version_major & 0xff;
+            cm_res.data[3] = (node_info.version_minor >> 8) & 0xff;
+            cm_res.data[4] = node_info.version_minor & 0xff;
+            cm_res.dlc = 5;
+            break;
+        case NODE_BUILD_INFO_STD_REGISTER:
+            // segmented, up to the terminating '\0'
+            put_value(&cm_res, (const uint8_t *)node_info.build_info,
+                      strnlen(node_info.build_info, H9MSG_MAX_REGISTER_SIZE - 1) + 1, 1);
+            return 0;
+        case NODE_ID_STD_REGISTER:
+            cm_res.data[1] = (can_node_id >> 8) & 0x01;
+            cm_res.data[2] = (can_node_id) & 0xff;
+            cm_res.dlc = 3;
+            break;
+        case NODE_MCU_TYPE_STD_REGISTER:
+#if defined (__AVR_ATmega16M1__)
+            cm_res.data[1] = NODE_MCU_ATMEGA16M1;
+#elif defined (__AVR_ATmega32M1__)
+            cm_res.data[1] = NODE_MCU_ATMEGA32M1;
+#elif defined (__AVR_ATmega64M1__)
+            cm_res.data[1] = NODE_MCU_ATMEGA64M1;
+#elif defined (__AVR_AT90CAN128__)
+            cm_res.data[1] = NODE_MCU_AT90CAN128;
+#elif defined (__AVR_ATmega32C1__)
+            cm_res.data[2] = NODE_MCU_ATMEGA32C1;
+#else
+#error Unsupported MCU
+#endif
+            cm_res.dlc = 2;
+            break;
+        case NODE_SN_STD_REGISTER: //CPU serial ID
+            cm_res.data[1] = 0;
+            cm_res.data[2] = 0;
+            cm_res.data[3] = 0;
+            cm_res.data[4] = 0;
+            cm_res.dlc = 5;
+        case NODE_RESET_REASON_STD_REGISTER:
+            cm_res.data[1] = reset_reason;
+            cm_res.dlc = 2;
+            break;
+        case NODE_CAN_STATS_STD_REGISTER:
+        case NODE_CAN_ERRORS_STD_REGISTER: {
+            uint8_t value[CAN_ERRORS_REG_SIZE];
+            uint8_t length = stats_reg_value(cm_res.data[0], value);
+            put_value(&cm_res, value, length, length > 7);
+            return 0;
+        }
+        default:
+            cm_res.type = H9MSG_TYPE_ERROR;
+            cm_res.data[0] = H9FRAME_ERROR_INVALID_REGISTER;
+            cm_res.dlc = 1;
+    }
+    CAN_put_msg(&cm_res);
+    return 0;
+}
+
+
+// the responses of a batched GET_REG one by one, while the tx queue has room for a whole frame
+void put_tx_batch(void) {
+    while (tx_batch.next < tx_batch.req.dlc) {
+        if (tx_segments.offset < tx_segments.length)
+            return; // a segmented value takes its turn
+        if (tx_free(tx_batch.req.priority) < CAN_BUF_HEADER_SIZE + 8)
+            return;
+
+        h9msg_t req = tx_batch.req;
+        req.dlc = 1;
+        req.data[0] = tx_batch.req.data[tx_batch.next++];
+        if (get_reg(&req)) { // an application register without CAN_set_registers
+            h9msg_t cm_res;
+            CAN_init_response_msg(&req, &cm_res);
+            cm_res.type = H9MSG_TYPE_ERROR;
+            cm_res.data[0] = H9FRAME_ERROR_INVALID_REGISTER;
+            cm_res.dlc = 1;
+            CAN_put_msg(&cm_res);
+        }
+    }
+}
+
+
+void CAN_set_registers(const can_reg_t *table, uint8_t count) {
+    reg_table = table;
+    reg_count = count;
+}
+
+
+// GET_REG/SET_REG of an application register or a bit operation, left to the application without a table
+uint8_t process_reg_msg(h9msg_t *cm) {
+    if (!reg_table)
+        return 1;
+
+    h9msg_t cm_res;
+    CAN_init_response_msg(cm, &cm_res);
+    uint8_t reg = cm->data[0];
+    can_reg_t desc;
+    uint8_t value[H9MSG_MAX_REGISTER_SIZE];
+    const uint8_t *written = &cm->data[1];
+    uint8_t error = 0;
+
+    if (!read_reg_desc(reg, &desc)) {
+        error = H9FRAME_ERROR_INVALID_REGISTER;
+    }
+    else if (cm->type == H9MSG_TYPE_GET_REG) {
+        if (!(desc.flags & CAN_REG_READ))
+            error = H9FRAME_ERROR_WRITE_ONLY_REGISTER;
+    }
+    else if (!(desc.flags & CAN_REG_WRITE)) {
+        error = H9FRAME_ERROR_READ_ONLY_REGISTER;
+    }
+    else if (cm->type == H9MSG_TYPE_SET_REG) {
+        if (desc.size > CAN_REG_FRAME_VALUE_SIZE) {
+            error = get_rx_segment(cm, &desc);
+            if (error == 0xff)
+                return 0; // more segments to come
+            written = rx_segments.value;
+        }
+        else if (cm->dlc != 1 + desc.size) {
+            error = H9FRAME_ERROR_REGISTER_SIZE_MISMATCH;
+        }
+        if (!error)
+            error = write_reg(reg, &desc, written);
+    }
+    else if (!(desc.flags & CAN_REG_READ)) {
+        error = H9FRAME_ERROR_WRITE_ONLY_REGISTER; // a bit operation needs the current value
+    }
+    else if (cm->data[1] >= desc.size * 8) {
+        error = H9FRAME_ERROR_REGISTER_SIZE_MISMATCH;
+    }
+    else {
+        read_reg(reg, &desc, value);
+        uint8_t *byte = &value[desc.size - 1 - cm->data[1] / 8]; // bit 0 is the lsb of the last byte
+        uint8_t mask = 1 << (cm->data[1] % 8);
+        if (cm->type == H9MSG_TYPE_SET_BIT)
+            *byte |= mask;
+        else if (cm->type == H9MSG_TYPE_CLEAR_BIT)
+            *byte &= ~mask;
+        else
+            *byte ^= mask;
+        error = write_reg(reg, &desc, value);
+    }
+
+    if (error) {
+        cm_res.type = H9MSG_TYPE_ERROR;
+        cm_res.data[0] = error;
+        cm_res.dlc = 1;
+        CAN_put_msg(&cm_res);
+        return 0;
+    }
+
+    cm_res.data[0] = reg;
+    if (desc.flags & CAN_REG_READ)
+        read_reg(reg, &desc, value);
+    else
+        memcpy(value, written, desc.size);
+    put_value(&cm_res, value, desc.size, desc.size > CAN_REG_FRAME_VALUE_SIZE);
+    return 0;
+}
+
+
+/*
+ * Collects a segmented SET_REG value in rx_segments, a segment out of order breaks the transfer.
+ * @return 0xff - more segments expected, 0 - the value is complete, H9FRAME_ERROR_*
+ */
+uint8_t get_rx_segment(const h9msg_t *cm, const can_reg_t *desc) {
+    uint8_t segment = cm->data[1] & ~H9MSG_SEGMENT_LAST;
+    uint8_t chunk = cm->dlc - 2;
+
+    if (segment == 0) {
+        rx_segments.source_id = cm->source_id;
+        rx_segments.seqnum = cm->seqnum;
+        rx_segments.reg = cm->data[0];
+        rx_segments.segment = 0;
+        rx_segments.length = 0;
+    }
+    if (segment != rx_segments.segment || cm->source_id != rx_segments.source_id || cm->seqnum != rx_segments.seqnum
+        || cm->data[0] != rx_segments.reg || rx_segments.length + chunk > desc->size) {
+        rx_segments.segment = 0xff;
+        return H9FRAME_ERROR_INVALID_MSG;
+    }
+
+    memcpy(&rx_segments.value[rx_segments.length], &cm->data[2], chunk);
+    rx_segments.length += chunk;
+    ++rx_segments.segment;
+
+    if (!(cm->data[1] & H9MSG_SEGMENT_LAST))
+        return 0xff;
+    rx_segments.segment = 0xff;
+    return rx_segments.length == desc->size ? 0 : H9FRAME_ERROR_REGISTER_SIZE_MISMATCH;
+}
+
+
+// O(1), the table is indexed by the register number
+uint8_t read_reg_desc(uint8_t reg, can_reg_t *desc) {
+    uint8_t idx = reg - CAN_FIRST_APP_REGISTER;
+    if (reg < CAN_FIRST_APP_REGISTER || idx >= reg_count)
+        return 0;
+    memcpy_P(desc, &reg_table[idx], sizeof(*desc));
+    return desc->size != 0;
+}
+
+
+void read_reg(uint8_t reg, const can_reg_t *desc, uint8_t *value) {
+    if (desc->get) {
+        desc->get(reg, value);
+    }
+    else if (desc->flags & CAN_REG_INT) {
+        const uint8_t *mem = desc->value;
+        for (uint8_t i = 0; i < desc->size; ++i)
+            value[i] = mem[desc->size - 1 - i];
+    }
+    else {
+        memcpy(value, desc->value, desc->size);
+    }
+}
+
+
+uint8_t write_reg(uint8_t reg, const can_reg_t *desc, const uint8_t *value) {
+    if (desc->set)
+        return desc->set(reg, value);
+
+    uint8_t *mem = desc->value;
+    if (desc->flags & CAN_REG_INT) {
+        for (uint8_t i = 0; i < desc->size; ++i)
+            mem[desc->size - 1 - i] = value[i];
+    }
+    else {
+        memcpy(mem, value, desc->size);
+    }
+    return 0;
+}
+
+
 void CAN_send_turned_on_broadcast(void) {
     h9msg_t cm;
     CAN_init_new_msg(&cm);
@@ -378,64 +854,438 @@ void CAN_send_turned_on_broadcast(void) {
 }
 
 
-void CAN_set_mob_for_remote_node1(uint16_t remote_node_id, uint8_t all_msg_group) {
-    CANPAGE = 0x03 << MOBNB0; //select mob 3
-    if (all_msg_group) {
-        set_CAN_id(0, H9MSG_NODE_ALL_REMOTE_MSG_GROUP, 0, 0, remote_node_id);
-        set_CAN_id_mask(0, H9MSG_NODE_ALL_REMOTE_MSG_GROUP_MASK, 0, 0, (1<<H9MSG_ID_BIT_LENGTH)-1);
-    }
-    else {
-        set_CAN_id(0, H9MSG_NODE_RESPONSE_MSG_GROUP, 0, 0, remote_node_id);
-        set_CAN_id_mask(0, H9MSG_NODE_RESPONSE_MSG_GROUP_MASK, 0, 0, (1<<H9MSG_ID_BIT_LENGTH)-1);
+static void set_mob_for_remote_node(uint8_t mob, uint16_t remote_node_id, uint8_t all_msg_group) {
+    can_subscription_t subscription = { remote_node_id, all_msg_group };
+    can_filter_t filter;
+    subscription_filter(&subscription, &filter);
+    subscriptions = NULL;
+    set_rx_filter(mob, &filter);
+}
+
+
+void set_rx_filter(uint8_t mob, const can_filter_t *filter) {
+    uint8_t cangie = can_int_mask();
+    uint8_t from_tx = can_tx_mobs & (1 << mob);
+    if (from_tx) {
+        // no waiting for the bus here: the loaded frames go back to their queues, in order from the highest MOb
+        for (int8_t busy = 5; busy >= 0; --busy) {
+            if (can_tx_mobs & (1 << busy))
+                unload_tx_mob(busy);
+        }
+        can_tx_mobs &= ~(1 << mob);
     }
+
+    remote_filters[mob - CAN_REMOTE_MOB_FIRST] = *filter;
+    write_rx_filter(mob, filter);
+
+    CANIE2 |= 1 << mob;
+    if (from_tx)
+        load_tx_queue();
+    can_int_restore(cangie);
+}
+
+
+void write_rx_filter(uint8_t mob, const can_filter_t *filter) {
+    CANPAGE = mob << MOBNB0;
+    CANSTMOB = 0x00;
+    set_CAN_id(0, filter->type, 0, 0, filter->source_id);
+    set_CAN_id_mask(0, filter->type_mask, 0, 0, filter->source_mask);
     CANIDM4 |= 1 << IDEMSK; // set filter
     CANCDMOB = (1<<CONMOB1) | (1<<IDE); //rx mob, 29-bit only
+}
+
 
-    CANIE2 |= 1 << IEMOB3;
+// back to the tx pool
+void release_rx_mob(uint8_t mob) {
+    if (can_tx_mobs & (1 << mob))
+        return;
+    uint8_t cangie = can_int_mask();
+    CANPAGE = mob << MOBNB0;
+    CANCDMOB = 0x00;
+    CANSTMOB = 0x00;
+    can_tx_mobs |= 1 << mob;
+    load_tx_queue();
+    can_int_restore(cangie);
 }
 
 
-void CAN_set_mob_for_remote_node2(uint16_t remote_node_id, uint8_t all_msg_group) {
-    CANPAGE = 0x04 << MOBNB0; //select mob 4
-    if (all_msg_group) {
-        set_CAN_id(0, H9MSG_NODE_ALL_REMOTE_MSG_GROUP, 0, 0, remote_node_id);
-        set_CAN_id_mask(0, H9MSG_NODE_ALL_REMOTE_MSG_GROUP_MASK, 0, 0, (1<<H9MSG_ID_BIT_LENGTH)-1);
+uint16_t CAN_subscribe(const can_subscription_t *list, uint8_t count, uint8_t max_mobs) {
+    if (max_mobs > CAN_REMOTE_MOB_COUNT)
+        max_mobs = CAN_REMOTE_MOB_COUNT;
+    if (!max_mobs)
+        count = 0;
+
+    // one filter per subscription; over max_mobs the pair that widens least is merged
+    can_filter_t filters[CAN_REMOTE_MOB_COUNT + 1];
+    uint8_t used = 0;
+    for (uint8_t i = 0; i < count; ++i) {
+        subscription_filter(&list[i], &filters[used++]);
+        if (used <= max_mobs)
+            continue;
+
+        uint8_t best_a = 0, best_b = 1;
+        uint16_t best_growth = UINT16_MAX;
+        for (uint8_t a = 0; a < used; ++a) {
+            for (uint8_t b = a + 1; b < used; ++b) {
+                can_filter_t merged;
+                merge_filters(&filters[a], &filters[b], &merged);
+                uint16_t merged_size = filter_size(&merged);
+                uint16_t parts_size = filter_size(&filters[a]) + filter_size(&filters[b]);
+                uint16_t growth = merged_size > parts_size ? merged_size - parts_size : 0;
+                if (growth < best_growth) {
+                    best_growth = growth;
+                    best_a = a;
+                    best_b = b;
+                }
+            }
+        }
+        merge_filters(&filters[best_a], &filters[best_b], &filters[best_a]);
+        filters[best_b] = filters[--used];
+    }
+
+    for (uint8_t idx = 0; idx < CAN_REMOTE_MOB_COUNT; ++idx) {
+        if (idx < used)
+            set_rx_filter(CAN_REMOTE_MOB_FIRST + idx, &filters[idx]);
+        else
+            release_rx_mob(CAN_REMOTE_MOB_FIRST + idx);
+    }
+
+    // (source id, type) pairs let through beyond the list
+    uint16_t extra = 0;
+    for (uint16_t source_id = 0; source_id < H9MSG_BROADCAST_ID; ++source_id) {
+        uint16_t accepted = 0;
+        for (uint8_t idx = 0; idx < used; ++idx)
+            accepted |= filter_types(&filters[idx], source_id);
+        uint16_t wanted = 0;
+        for (uint8_t i = 0; i < count; ++i) {
+            if (list[i].source_id == source_id) {
+                can_filter_t filter;
+                subscription_filter(&list[i], &filter);
+                wanted |= filter_types(&filter, source_id);
+            }
+        }
+        for (accepted &= ~wanted; accepted; accepted &= accepted - 1)
+            ++extra;
+    }
+
+    subscriptions = extra ? list : NULL;
+    subscription_count = count;
+    return extra;
+}
+
+
+void subscription_filter(const can_subscription_t *subscription, can_filter_t *filter) {
+    filter->source_id = subscription->source_id;
+    filter->source_mask = (1<<H9MSG_ID_BIT_LENGTH)-1;
+    if (subscription->all_msg_group) {
+        filter->type = H9MSG_NODE_ALL_REMOTE_MSG_GROUP;
+        filter->type_mask = H9MSG_NODE_ALL_REMOTE_MSG_GROUP_MASK;
     }
     else {
-        set_CAN_id(0, H9MSG_NODE_RESPONSE_MSG_GROUP, 0, 0, remote_node_id);
-        set_CAN_id_mask(0, H9MSG_NODE_RESPONSE_MSG_GROUP_MASK, 0, 0, (1<<H9MSG_ID_BIT_LENGTH)-1);
+        filter->type = H9MSG_NODE_RESPONSE_MSG_GROUP;
+        filter->type_mask = H9MSG_NODE_RESPONSE_MSG_GROUP_MASK;
     }
-    CANIDM4 |= 1 << IDEMSK; // set filter
-    CANCDMOB = (1<<CONMOB1) | (1<<IDE); //rx mob, 29-bit only
-    
-    CANIE2 |= 1 << IEMOB4;
+}
+
+
+// the narrowest filter accepting both, the bits they differ in become don't care
+void merge_filters(const can_filter_t *a, const can_filter_t *b, can_filter_t *merged) {
+    uint16_t source_mask = a->source_mask & b->source_mask & ~(a->source_id ^ b->source_id);
+    uint8_t type_mask = a->type_mask & b->type_mask & ~(a->type ^ b->type);
+    merged->source_id = a->source_id & source_mask;
+    merged->source_mask = source_mask;
+    merged->type = a->type & type_mask;
+    merged->type_mask = type_mask;
+}
+
+
+// bit n - the filter accepts type H9MSG_NODE_ALL_REMOTE_MSG_GROUP + n from source_id
+uint16_t filter_types(const can_filter_t *filter, uint16_t source_id) {
+    if ((source_id & filter->source_mask) != (filter->source_id & filter->source_mask))
+        return 0;
+    uint16_t types = 0;
+    for (uint8_t n = 0; n < 16; ++n) {
+        uint8_t type = H9MSG_NODE_ALL_REMOTE_MSG_GROUP + n;
+        if ((type & filter->type_mask) == (filter->type & filter->type_mask))
+            types |= 1 << n;
+    }
+    return types;
+}
+
+
+// (source id, remote type) pairs accepted
+uint16_t filter_size(const can_filter_t *filter) {
+    uint16_t sources = 1;
+    for (uint16_t bit = 1; bit < (1<<H9MSG_ID_BIT_LENGTH); bit <<= 1) {
+        if (!(filter->source_mask & bit))
+            sources <<= 1;
+    }
+    uint16_t types = filter_types(filter, filter->source_id);
+    uint8_t type_count = 0;
+    for (; types; types &= types - 1)
+        ++type_count;
+    return sources * type_count;
+}
+
+
+// the software part of the CAN_subscribe filtering
+uint8_t remote_subscribed(uint16_t source_id, uint8_t type) {
+    if (!subscriptions)
+        return 1;
+    for (uint8_t i = 0; i < subscription_count; ++i) {
+        if (subscriptions[i].source_id == source_id
+            && (subscriptions[i].all_msg_group
+                || (type & H9MSG_NODE_RESPONSE_MSG_GROUP_MASK) == H9MSG_NODE_RESPONSE_MSG_GROUP))
+            return 1;
+    }
+    return 0;
+}
+
+
+void CAN_set_mob_for_remote_node1(uint16_t remote_node_id, uint8_t all_msg_group) {
+    set_mob_for_remote_node(3, remote_node_id, all_msg_group); //mob 3
+}
+
+
+void CAN_set_mob_for_remote_node2(uint16_t remote_node_id, uint8_t all_msg_group) {
+    set_mob_for_remote_node(4, remote_node_id, all_msg_group); //mob 4
 }
 
 
 void CAN_set_mob_for_remote_node3(uint16_t remote_node_id, uint8_t all_msg_group) {
-    CANPAGE = 0x05 << MOBNB0; //select mob 5
-    if (all_msg_group) {
-        set_CAN_id(0, H9MSG_NODE_ALL_REMOTE_MSG_GROUP, 0, 0, remote_node_id);
-        set_CAN_id_mask(0, H9MSG_NODE_ALL_REMOTE_MSG_GROUP_MASK, 0, 0, (1<<H9MSG_ID_BIT_LENGTH)-1);
+    set_mob_for_remote_node(5, remote_node_id, all_msg_group); //mob 5
+}
+
+
+/*
+ * Masks only the CAN interrupt, the other interrupts of the application keep running. CAN_INT_vect changes
+ * ENOVRT, so clearing ENIT is atomic; with ENIT clear nothing else writes CANGIE and the restore puts back
+ * ENIT alone.
+ */
+uint8_t can_int_mask(void) {
+    uint8_t sreg = SREG;
+    cli();
+    uint8_t cangie = CANGIE;
+    CANGIE = cangie & ~(1 << ENIT);
+    SREG = sreg;
+    return cangie;
+}
+
+
+void can_int_restore(uint8_t cangie) {
+    if (cangie & (1 << ENIT))
+        CANGIE |= 1 << ENIT;
+}
+
+
+/*
+ * The controller sends the ready MOb with the lowest number first. A low priority frame goes only to
+ * a tx MOb above every busy one, so the bus sees the frames in the queue order. A high priority frame
+ * goes above the busy high priority MObs only and may overtake the low priority frames.
+ * @retval -1 - no tx MOb available
+ */
+int8_t next_tx_mob(uint8_t priority) {
+    uint8_t enabled = CANEN2 & can_tx_mobs;
+    uint8_t busy = priority == H9MSG_PRIORITY_HIGH ? enabled & can_tx_high_mobs : enabled;
+    for (int8_t mob = 0; mob < 6; ++mob) {
+        uint8_t mob_bit = 1 << mob;
+        if ((can_tx_mobs & mob_bit) && !(enabled & mob_bit) && busy < mob_bit)
+            return mob;
+    }
+    return -1;
+}
+
+
+// with the CAN interrupt masked or from CAN_INT_vect
+static void load_tx_mob(uint8_t mob, uint8_t priority) {
+    uint8_t *buf = can_tx_buf[priority];
+    uint8_t bottom = can_tx_buf_bottom[priority];
+
+    CANPAGE = mob << MOBNB0;
+    CANSTMOB = 0x00;
+
+    uint8_t cancdmob = buf[bottom];
+    bottom = (uint8_t)((bottom + 1) & CAN_TX_BUF_INDEX_MASK);
+    CANIDT1 = buf[bottom];
+    bottom = (uint8_t)((bottom + 1) & CAN_TX_BUF_INDEX_MASK);
+    CANIDT2 = buf[bottom];
+    bottom = (uint8_t)((bottom + 1) & CAN_TX_BUF_INDEX_MASK);
+    CANIDT3 = buf[bottom];
+    bottom = (uint8_t)((bottom + 1) & CAN_TX_BUF_INDEX_MASK);
+    CANIDT4 = buf[bottom];
+    bottom = (uint8_t)((bottom + 1) & CAN_TX_BUF_INDEX_MASK);
+
+    uint8_t payload = CAN_BUF_PAYLOAD(cancdmob);
+    for (uint8_t idx = 0; idx < payload; ++idx) {
+        CANMSG = buf[bottom];
+        bottom = (uint8_t)((bottom + 1) & CAN_TX_BUF_INDEX_MASK);
+    }
+
+    CANCDMOB = (1 << CONMOB0) | (1 << IDE) | (cancdmob & 0x0f);
+
+    if (priority == H9MSG_PRIORITY_HIGH)
+        can_tx_high_mobs |= 1 << mob;
+    else
+        can_tx_high_mobs &= ~(1 << mob);
+    CAN_BARRIER();
+    can_tx_buf_bottom[priority] = bottom;
+}
+
+
+void load_tx_queue(void) {
+    if (bus_off_hold)
+        return;
+    int8_t mob;
+    while (can_tx_buf_top[H9MSG_PRIORITY_HIGH] != can_tx_buf_bottom[H9MSG_PRIORITY_HIGH] && (mob = next_tx_mob(H9MSG_PRIORITY_HIGH)) >= 0)
+        load_tx_mob(mob, H9MSG_PRIORITY_HIGH);
+    while (can_tx_buf_top[H9MSG_PRIORITY_LOW] != can_tx_buf_bottom[H9MSG_PRIORITY_LOW] && (mob = next_tx_mob(H9MSG_PRIORITY_LOW)) >= 0)
+        load_tx_mob(mob, H9MSG_PRIORITY_LOW);
+}
+
+
+/*
+ * With the CAN interrupt masked: the frame of a busy tx MOb, or of one stopped by a bus off, goes back to the
+ * head of its queue, a full queue drops it. A frame already on the bus when the MOb is disabled may go out
+ * twice.
+ */
+void unload_tx_mob(uint8_t mob) {
+    uint8_t mob_bit = 1 << mob;
+    CANPAGE = mob << MOBNB0;
+    uint8_t cancdmob;
+    if (requeue_mobs & mob_bit) {
+        cancdmob = requeue_cdmob[mob];
+        requeue_mobs &= ~mob_bit;
+    }
+    else if (CANEN2 & can_tx_mobs & mob_bit) {
+        cancdmob = CANCDMOB;
+        CANCDMOB = 0;
     }
     else {
-        set_CAN_id(0, H9MSG_NODE_RESPONSE_MSG_GROUP, 0, 0, remote_node_id);
-        set_CAN_id_mask(0, H9MSG_NODE_RESPONSE_MSG_GROUP_MASK, 0, 0, (1<<H9MSG_ID_BIT_LENGTH)-1);
+        return;
     }
-    CANIDM4 |= 1 << IDEMSK; // set filter
-    CANCDMOB = (1<<CONMOB1) | (1<<IDE); //rx mob, 29-bit only
-    
-    CANIE2 |= 1 << IEMOB5;
+    tx_mob_errors[mob] = 0;
+
+    uint8_t priority = can_tx_high_mobs & mob_bit ? H9MSG_PRIORITY_HIGH : H9MSG_PRIORITY_LOW;
+    uint8_t payload = CAN_BUF_PAYLOAD(cancdmob);
+    // below the queue head, a reserved frame keeps its bytes
+    if (tx_space(priority) - tx_reserved[priority] < CAN_BUF_HEADER_SIZE + payload) {
+        CAN_STAT_INC(can_stats.tx_drops);
+        return;
+    }
+
+    uint8_t *buf = can_tx_buf[priority];
+    uint8_t bottom = (uint8_t)((can_tx_buf_bottom[priority] - CAN_BUF_HEADER_SIZE - payload) & CAN_TX_BUF_INDEX_MASK);
+    uint8_t idx = bottom;
+    buf[idx] = cancdmob & 0x0f;
+    idx = (uint8_t)((idx + 1) & CAN_TX_BUF_INDEX_MASK);
+    buf[idx] = CANIDT1;
+    idx = (uint8_t)((idx + 1) & CAN_TX_BUF_INDEX_MASK);
+    buf[idx] = CANIDT2;
+    idx = (uint8_t)((idx + 1) & CAN_TX_BUF_INDEX_MASK);
+    buf[idx] = CANIDT3;
+    idx = (uint8_t)((idx + 1) & CAN_TX_BUF_INDEX_MASK);
+    buf[idx] = CANIDT4;
+    idx = (uint8_t)((idx + 1) & CAN_TX_BUF_INDEX_MASK);
+    for (uint8_t i = 0; i < payload; ++i) {
+        buf[idx] = CANMSG;
+        idx = (uint8_t)((idx + 1) & CAN_TX_BUF_INDEX_MASK);
+    }
+    CAN_BARRIER();
+    can_tx_buf_bottom[priority] = bottom;
 }
 
 
-uint8_t CAN_try_put_msg(h9msg_t *cm) {
-    CANPAGE = 0 << MOBNB0;              // Select MOb0 for transmission
+// CAN_STMOB error bits, the general SERG..AERG ones are at the same positions
+void count_errors(uint8_t flags) {
+    if (flags & (1 << BERR))
+        CAN_STAT_INC(can_stats.bit_errors);
+    if (flags & (1 << SERR))
+        CAN_STAT_INC(can_stats.stuff_errors);
+    if (flags & (1 << CERR))
+        CAN_STAT_INC(can_stats.crc_errors);
+    if (flags & (1 << FERR))
+        CAN_STAT_INC(can_stats.form_errors);
+    if (flags & (1 << AERR))
+        CAN_STAT_INC(can_stats.ack_errors);
+}
+
+
+// from CAN_INT_vect, stops the busy tx MObs and starts the backoff
+void bus_off(void) {
+    CAN_STAT_INC(can_stats.bus_offs);
+    if (bus_off_in_row < CAN_BUS_OFF_REQUEUE_LIMIT)
+        ++bus_off_in_row;
+
+    uint8_t busy = CANEN2 & can_tx_mobs;
+    for (uint8_t mob = 0; mob < 6; ++mob) {
+        uint8_t mob_bit = 1 << mob;
+        if (!(busy & mob_bit))
+            continue;
+        CANPAGE = mob << MOBNB0;
+        if (bus_off_in_row < CAN_BUS_OFF_REQUEUE_LIMIT) {
+            requeue_cdmob[mob] = CANCDMOB & ((1 << IDE) | 0x0f);
+            requeue_mobs |= mob_bit;
+        }
+        else {
+            CAN_STAT_INC(can_stats.tx_drops);
+        }
+        CANCDMOB = 0;
+        CANSTMOB = 0x00;
+        tx_mob_errors[mob] = 0;
+    }
+
+    bus_off_hold = bus_off_backoff;
+    bus_off_stuck = 0;
+    if (bus_off_backoff < CAN_BUS_OFF_BACKOFF_MAX)
+        bus_off_backoff <<= 1;
+    CANGIE |= 1 << ENOVRT;
+}
+
+
+// from CAN_INT_vect on the CAN timer overflow, restarts the stopped tx MObs when the backoff is over
+void bus_off_tick(void) {
+    if (bus_off_hold) {
+        if (--bus_off_hold)
+            return;
+        if (CANGSTA & (1 << BOFF)) {
+            /*
+             * Not back on the bus yet: the controller leaves bus off by itself after 128 runs of 11 recessive
+             * bits. A bus that never gets that quiet keeps it there, the software reset is the other way out.
+             */
+            if (++bus_off_stuck < CAN_BUS_OFF_RESTART_TICKS) {
+                bus_off_hold = 1;
+                return;
+            }
+            for (int8_t mob = 5; mob >= 0; --mob) // the reset disables the MObs, their frames wait in the queues
+                unload_tx_mob(mob);
+            start_controller();
+        }
+        for (uint8_t mob = 0; mob < 6; ++mob) {
+            if (requeue_mobs & (1 << mob)) {
+                CANPAGE = mob << MOBNB0;
+                CANSTMOB = 0x00;
+                CANCDMOB = (1 << CONMOB0) | requeue_cdmob[mob]; // id and data are still in the MOb
+            }
+        }
+        requeue_mobs = 0;
+    }
+    if (bulk_tx.state == CAN_BULK_CLOSED) // the stream needs the timer for its timeout
+        CANGIE &= ~(1 << ENOVRT);
+    load_tx_queue();
+}
 
-    if (CANEN2 & ( 1 << ENMOB0 )) {
+
+uint8_t CAN_try_put_msg(h9msg_t *cm) {
+    uint8_t cangie = can_int_mask();
+    int8_t mob = next_tx_mob(cm->priority);
+    // queued frames of the same or higher priority go first
+    if (mob < 0 || bus_off_hold || can_tx_buf_top[H9MSG_PRIORITY_HIGH] != can_tx_buf_bottom[H9MSG_PRIORITY_HIGH]
+        || (cm->priority == H9MSG_PRIORITY_LOW && can_tx_buf_top[H9MSG_PRIORITY_LOW] != can_tx_buf_bottom[H9MSG_PRIORITY_LOW])) {
+        can_int_restore(cangie);
         return 0;
     }
-    
+
+    CANPAGE = mob << MOBNB0;            // Select free tx MOb
     CANSTMOB = 0x00;                    // Clear mob status register
 
     set_CAN_id(cm->priority, cm->type, cm->seqnum, cm->destination_id, cm->source_id);
@@ -444,51 +1294,523 @@ uint8_t CAN_try_put_msg(h9msg_t *cm) {
         CANMSG = cm->data[idx];
 
     CANCDMOB = (1 << CONMOB0) | (1 << IDE) | (cm->dlc & 0x0f);
+
+    if (cm->priority == H9MSG_PRIORITY_HIGH)
+        can_tx_high_mobs |= 1 << mob;
+    else
+        can_tx_high_mobs &= ~(1 << mob);
+    can_int_restore(cangie);
     return 1;
 }
 
 uint8_t CAN_put_msg(h9msg_t *cm) {
-    cli();
-    uint8_t ret = 0;
-    if (CAN_try_put_msg(cm)) {
-        ret = 1;
+    uint8_t priority = cm->priority;
+    // the bytes past the queue top are free for unload_tx_mob until publish_tx
+    uint8_t cangie = can_int_mask();
+    if (!tx_room(priority, cm->dlc)) {
+        can_int_restore(cangie);
+        return 0;
+    }
+
+    uint8_t top = write_tx_header(priority, can_tx_buf_top[priority], cm->type, cm->seqnum, cm->destination_id, cm->source_id, cm->dlc);
+    uint8_t payload = CAN_BUF_PAYLOAD(cm->dlc);
+    for (uint8_t idx = 0; idx < payload; ++idx) {
+        can_tx_buf[priority][top] = cm->data[idx];
+        top = (uint8_t)((top + 1) & CAN_TX_BUF_INDEX_MASK);
+    }
+
+    uint8_t ret = publish_tx(priority, top);
+    can_int_restore(cangie);
+    return ret;
+}
+
+
+uint8_t CAN_reserve_msg(can_tx_frame_t *tx, uint8_t priority, uint8_t dlc) {
+    if (!reserve_tx(priority, dlc))
+        return 0;
+
+    tx->priority = priority;
+    tx->seqnum = next_seqnum++;
+    tx->dlc = dlc;
+    tx->head = can_tx_buf_top[priority];
+    return 1;
+}
+
+
+uint8_t CAN_reserve_response(const can_frame_t *req, can_tx_frame_t *tx, uint8_t dlc) {
+    uint8_t priority = CAN_frame_priority(req);
+    if (!reserve_tx(priority, dlc))
+        return 0;
+
+    tx->priority = priority;
+    tx->type = response_type(CAN_frame_type(req));
+    tx->seqnum = CAN_frame_seqnum(req);
+    tx->destination_id = CAN_frame_source_id(req);
+    tx->dlc = dlc;
+    tx->head = can_tx_buf_top[priority];
+    return 1;
+}
+
+
+void CAN_set_tx_frame_data(can_tx_frame_t *tx, uint8_t idx, uint8_t value) {
+    can_tx_buf[tx->priority][(uint8_t)((tx->head + CAN_BUF_HEADER_SIZE + idx) & CAN_TX_BUF_INDEX_MASK)] = value;
+}
+
+
+uint8_t CAN_commit_msg(can_tx_frame_t *tx) {
+    uint8_t top = write_tx_header(tx->priority, tx->head, tx->type, tx->seqnum, tx->destination_id, can_node_id, tx->dlc);
+    top = (uint8_t)((top + CAN_BUF_PAYLOAD(tx->dlc)) & CAN_TX_BUF_INDEX_MASK);
+    uint8_t cangie = can_int_mask();
+    tx_reserved[tx->priority] = 0;
+    uint8_t ret = publish_tx(tx->priority, top);
+    can_int_restore(cangie);
+    return ret;
+}
+
+
+// the room for a CAN_reserve_* frame, one per priority
+uint8_t reserve_tx(uint8_t priority, uint8_t dlc) {
+    // unload_tx_mob may take the free bytes from the CAN interrupt
+    uint8_t cangie = can_int_mask();
+    uint8_t ret = tx_room(priority, dlc);
+    if (ret)
+        tx_reserved[priority] = CAN_BUF_HEADER_SIZE + CAN_BUF_PAYLOAD(dlc);
+    can_int_restore(cangie);
+    return ret;
+}
+
+
+uint8_t tx_space(uint8_t priority) {
+    return (uint8_t)((can_tx_buf_bottom[priority] - can_tx_buf_top[priority] - 1) & CAN_TX_BUF_INDEX_MASK);
+}
+
+
+// the bytes a new frame may take at the queue top, none while a reserved frame is there
+uint8_t tx_free(uint8_t priority) {
+    return tx_reserved[priority] ? 0 : tx_space(priority);
+}
+
+
+// the frame with its payload fits the tx queue, a full queue counts as a drop
+uint8_t tx_room(uint8_t priority, uint8_t dlc) {
+    if (tx_free(priority) < CAN_BUF_HEADER_SIZE + CAN_BUF_PAYLOAD(dlc)) {
+        CAN_STAT_INC(can_stats.tx_drops);
+        return 0;
+    }
+    return 1;
+}
+
+
+// @return the tx ring index of the payload
+uint8_t write_tx_header(uint8_t priority, uint8_t top, uint8_t type, uint8_t seqnum, uint16_t destination_id, uint16_t source_id, uint8_t dlc) {
+    uint8_t *buf = can_tx_buf[priority];
+    buf[top] = dlc & 0x0f;
+    top = (uint8_t)((top + 1) & CAN_TX_BUF_INDEX_MASK);
+    buf[top] = calc_can_id1(priority, type, seqnum, destination_id, source_id);
+    top = (uint8_t)((top + 1) & CAN_TX_BUF_INDEX_MASK);
+    buf[top] = calc_can_id2(priority, type, seqnum, destination_id, source_id);
+    top = (uint8_t)((top + 1) & CAN_TX_BUF_INDEX_MASK);
+    buf[top] = calc_can_id3(priority, type, seqnum, destination_id, source_id);
+    top = (uint8_t)((top + 1) & CAN_TX_BUF_INDEX_MASK);
+    buf[top] = calc_can_id4(priority, type, seqnum, destination_id, source_id);
+    return (uint8_t)((top + 1) & CAN_TX_BUF_INDEX_MASK);
+}
+
+
+// the value after res->data[0], in one frame or in segments
+void put_value(h9msg_t *res, const uint8_t *value, uint8_t length, uint8_t segmented) {
+    if (!segmented) {
+        memcpy(&res->data[1], value, length);
+        res->dlc = 1 + length;
+        CAN_put_msg(res);
+        return;
+    }
+
+    // a new value replaces the rest of an unfinished one
+    tx_segments.msg = *res;
+    memcpy(tx_segments.value, value, length);
+    tx_segments.length = length;
+    tx_segments.offset = 0;
+    tx_segments.segment = 0;
+    put_tx_segments();
+}
+
+
+// as many segments as the tx queue takes now, the rest on the next CAN_get_msg/CAN_dispatch
+void put_tx_segments(void) {
+    h9msg_t *msg = &tx_segments.msg;
+    while (tx_segments.offset < tx_segments.length) {
+        uint8_t chunk = tx_segments.length - tx_segments.offset;
+        if (chunk > H9MSG_SEGMENT_VALUE_SIZE)
+            chunk = H9MSG_SEGMENT_VALUE_SIZE;
+        if (tx_free(msg->priority) < CAN_BUF_HEADER_SIZE + 2 + chunk)
+            return;
+
+        msg->data[1] = tx_segments.segment;
+        if (tx_segments.offset + chunk == tx_segments.length)
+            msg->data[1] |= H9MSG_SEGMENT_LAST;
+        memcpy(&msg->data[2], &tx_segments.value[tx_segments.offset], chunk);
+        msg->dlc = 2 + chunk;
+        CAN_put_msg(msg);
+
+        tx_segments.offset += chunk;
+        ++tx_segments.segment;
+    }
+}
+
+
+/*
+ * Moves the queue top past the new frame and hands it to a free tx MOb, the CAN_put_msg return value.
+ * With the CAN interrupt masked since the free bytes were counted: unload_tx_mob puts the frames of the
+ * MObs back below the queue head, from CAN_INT_vect too, and sees only the bytes up to the top as taken.
+ */
+uint8_t publish_tx(uint8_t priority, uint8_t top) {
+    CAN_BARRIER();
+    can_tx_buf_top[priority] = top;
+
+    // a free tx MOb takes the frame at once
+    load_tx_queue();
+    uint8_t used = (uint8_t)((top - can_tx_buf_bottom[priority]) & CAN_TX_BUF_INDEX_MASK);
+    if (used > can_stats.tx_high_water)
+        can_stats.tx_high_water = used;
+    return used ? 2 : 1;
+}
+
+
+uint8_t CAN_bulk_open(uint16_t destination_id, uint8_t *buf, uint16_t size) {
+    if (bulk_tx.state != CAN_BULK_CLOSED || !size || size > 32768)
+        return 0;
+    bulk_tx.buf = buf;
+    bulk_tx.size = size;
+    bulk_tx.head = 0;
+    bulk_tx.count = 0;
+    bulk_tx.sent = 0;
+    bulk_tx.cut = 0;
+    bulk_tx.destination_id = destination_id;
+    bulk_tx.base = 0;
+    bulk_tx.next = 0;
+    bulk_tx.top = 0;
+    bulk_tx.window = 0;
+    bulk_tx.polled = 0;
+    bulk_tx.control = H9MSG_BULK_OPEN;
+    bulk_tx.tick = can_ticks;
+    bulk_tx.retries = 0;
+    bulk_tx.state = CAN_BULK_OPENING;
+
+    uint8_t cangie = can_int_mask();
+    CANGIE |= 1 << ENOVRT;
+    can_int_restore(cangie);
+    bulk_pump();
+    return 1;
+}
+
+
+uint16_t CAN_bulk_write(const uint8_t *data, uint16_t length) {
+    if (bulk_tx.state != CAN_BULK_OPENING && bulk_tx.state != CAN_BULK_OPEN)
+        return 0;
+    if (length > bulk_tx.size - bulk_tx.count)
+        length = bulk_tx.size - bulk_tx.count;
+
+    uint16_t pos = bulk_tx.head + bulk_tx.count;
+    if (pos >= bulk_tx.size)
+        pos -= bulk_tx.size;
+    for (uint16_t idx = 0; idx < length; ++idx) {
+        bulk_tx.buf[pos] = data[idx];
+        if (++pos == bulk_tx.size)
+            pos = 0;
+    }
+    bulk_tx.count += length;
+    bulk_pump();
+    return length;
+}
+
+
+uint16_t CAN_bulk_pending(void) {
+    return bulk_tx.count;
+}
+
+
+void CAN_bulk_close(void) {
+    if (bulk_tx.state == CAN_BULK_OPENING) {
+        bulk_tx.state = CAN_BULK_CLOSED;
+    }
+    else if (bulk_tx.state == CAN_BULK_OPEN) {
+        bulk_tx.state = CAN_BULK_CLOSING;
+        if (!bulk_tx.count)
+            bulk_tx.control = H9MSG_BULK_CLOSE;
+        bulk_pump();
+    }
+}
+
+
+uint8_t CAN_bulk_state(void) {
+    return bulk_tx.state;
+}
+
+
+void CAN_bulk_listen(can_bulk_handler_t handler) {
+    bulk_rx.handler = handler;
+    bulk_rx.source_id = H9MSG_BROADCAST_ID;
+    bulk_rx.control = 0;
+}
+
+
+// a - b of the frame numbers
+uint8_t bulk_seq_diff(uint8_t a, uint8_t b) {
+    return a >= b ? a - b : (uint8_t)(a + H9MSG_BULK_SEQ_MODULO - b);
+}
+
+
+uint8_t bulk_seq_add(uint8_t seq, uint8_t n) {
+    uint8_t sum = seq + n;
+    return sum >= H9MSG_BULK_SEQ_MODULO ? sum - H9MSG_BULK_SEQ_MODULO : sum;
+}
+
+
+// a control frame only when it fits the tx queue, 0 - try again later
+uint8_t put_bulk_control(uint16_t destination_id, uint8_t op, uint8_t seq, uint8_t window, uint8_t dlc) {
+    if (tx_free(H9MSG_PRIORITY_LOW) < CAN_BUF_HEADER_SIZE + dlc)
+        return 0;
+    h9msg_t cm;
+    CAN_init_new_msg(&cm);
+    cm.type = H9MSG_TYPE_NODE_SPECIFIC_BULK0;
+    cm.destination_id = destination_id;
+    cm.data[0] = op;
+    cm.data[1] = seq;
+    cm.data[2] = window;
+    cm.dlc = dlc;
+    return CAN_put_msg(&cm);
+}
+
+
+// a bulk frame addressed to the node
+void bulk_msg(const h9msg_t *cm) {
+    if (cm->type == H9MSG_TYPE_NODE_SPECIFIC_BULK0) {
+        if (!cm->dlc)
+            return;
+        uint8_t op = cm->data[0];
+        if (op == H9MSG_BULK_OPEN) {
+            if (!bulk_rx.handler
+                || (bulk_rx.source_id != H9MSG_BROADCAST_ID && bulk_rx.source_id != cm->source_id)) {
+                put_bulk_control(cm->source_id, H9MSG_BULK_CLOSED, 0, 0, 1);
+                return;
+            }
+            bulk_rx.source_id = cm->source_id;
+            bulk_rx.expected = 0;
+            bulk_rx.unacked = 0;
+            bulk_rx.resend = 0;
+            bulk_rx.control = H9MSG_BULK_CREDIT;
+        }
+        else if (op == H9MSG_BULK_POLL) {
+            if (cm->source_id == bulk_rx.source_id && !bulk_rx.control)
+                bulk_rx.control = H9MSG_BULK_CREDIT;
+        }
+        else if (op == H9MSG_BULK_CLOSE && cm->dlc == 2) {
+            if (cm->source_id != bulk_rx.source_id) { // the CLOSED answer got lost
+                put_bulk_control(cm->source_id, H9MSG_BULK_CLOSED, 0, 0, 1);
+            }
+            else if (cm->data[1] != bulk_rx.expected) {
+                bulk_rx.control = H9MSG_BULK_RESEND;
+            }
+            else if (put_bulk_control(cm->source_id, H9MSG_BULK_CLOSED, 0, 0, 1)) {
+                bulk_rx.source_id = H9MSG_BROADCAST_ID;
+                bulk_rx.control = 0;
+                bulk_rx.handler(cm->source_id, NULL, 0);
+            }
+        }
+        else if ((op == H9MSG_BULK_CREDIT || op == H9MSG_BULK_RESEND) && cm->dlc == 3) {
+            if (cm->source_id == bulk_tx.destination_id && bulk_tx.state != CAN_BULK_CLOSED)
+                bulk_credit(op, cm->data[1], cm->data[2]);
+        }
+        else if (op == H9MSG_BULK_CLOSED) {
+            if (cm->source_id == bulk_tx.destination_id)
+                bulk_tx.state = CAN_BULK_CLOSED;
+        }
+    }
+    else if (cm->source_id == bulk_rx.source_id && cm->dlc) {
+        uint8_t seq = (cm->type - H9MSG_TYPE_NODE_SPECIFIC_BULK1) * 32 + cm->seqnum;
+        if (seq == bulk_rx.expected) {
+            bulk_rx.expected = bulk_seq_add(seq, 1);
+            bulk_rx.resend = 0;
+            if (++bulk_rx.unacked >= (CAN_BULK_RX_WINDOW + 1) / 2)
+                bulk_rx.control = H9MSG_BULK_CREDIT;
+            bulk_rx.handler(cm->source_id, cm->data, CAN_BUF_PAYLOAD(cm->dlc));
+        }
+        else if (bulk_seq_diff(seq, bulk_rx.expected) >= H9MSG_BULK_SEQ_MODULO - CAN_BULK_WINDOW_MAX) {
+            // a resent frame, the sender missed the credit
+            if (!bulk_rx.control)
+                bulk_rx.control = H9MSG_BULK_CREDIT;
+        }
+        else if (!bulk_rx.resend) {
+            bulk_rx.resend = 1;
+            bulk_rx.control = H9MSG_BULK_RESEND;
+        }
+    }
+    bulk_pump();
+}
+
+
+// the receiver acknowledged the frames before ack
+void bulk_credit(uint8_t op, uint8_t ack, uint8_t window) {
+    uint8_t acked = bulk_seq_diff(ack, bulk_tx.base);
+    if (acked > bulk_seq_diff(bulk_tx.top, bulk_tx.base))
+        return; // stale
+    if (bulk_tx.state == CAN_BULK_OPENING) {
+        bulk_tx.state = CAN_BULK_OPEN;
+        bulk_tx.control = 0;
+    }
+
+    uint8_t in_flight = bulk_seq_diff(bulk_tx.next, bulk_tx.base);
+    uint16_t bytes = 0;
+    for (uint8_t seq = bulk_tx.base; seq != ack; seq = bulk_seq_add(seq, 1))
+        bytes += bulk_tx.frame_length[seq % CAN_BULK_WINDOW_MAX];
+    bulk_tx.head += bytes;
+    if (bulk_tx.head >= bulk_tx.size)
+        bulk_tx.head -= bulk_tx.size;
+    bulk_tx.count -= bytes;
+    bulk_tx.cut -= bytes;
+    bulk_tx.base = ack;
+    if (op == H9MSG_BULK_RESEND || acked > in_flight) { // back to ack or past a rewind
+        bulk_tx.next = ack;
+        bulk_tx.sent = 0;
     }
     else {
-        uint8_t tmp_idx = (uint8_t) ((can_tx_buf_top + 1) & CAN_TX_BUF_INDEX_MASK);
+        bulk_tx.sent -= bytes;
+    }
+
+    bulk_tx.window = window > CAN_BULK_WINDOW_MAX ? CAN_BULK_WINDOW_MAX : window;
+    bulk_tx.tick = can_ticks;
+    bulk_tx.retries = 0;
+    if (bulk_tx.state == CAN_BULK_CLOSING && !bulk_tx.count)
+        bulk_tx.control = H9MSG_BULK_CLOSE;
+}
 
-        if (can_tx_buf_bottom != tmp_idx) {
-            can_tx_buf[can_tx_buf_top].canidt1 = calc_can_id1(cm->priority, cm->type, cm->seqnum, cm->destination_id, cm->source_id);
-            can_tx_buf[can_tx_buf_top].canidt2 = calc_can_id2(cm->priority, cm->type, cm->seqnum, cm->destination_id, cm->source_id);
-            can_tx_buf[can_tx_buf_top].canidt3 = calc_can_id3(cm->priority, cm->type, cm->seqnum, cm->destination_id, cm->source_id);
-            can_tx_buf[can_tx_buf_top].canidt4 = calc_can_id4(cm->priority, cm->type, cm->seqnum, cm->destination_id, cm->source_id);
 
-            for (uint8_t idx = 0; idx < cm->dlc; ++idx)
-                can_tx_buf[can_tx_buf_top].data[idx] = cm->data[idx];
+// the pending control frames and as many stream frames as the window and the tx queue reserve allow
+void bulk_pump(void) {
+    if (bulk_rx.control && put_bulk_control(bulk_rx.source_id, bulk_rx.control, bulk_rx.expected, CAN_BULK_RX_WINDOW, 3)) {
+        bulk_rx.control = 0;
+        bulk_rx.unacked = 0;
+    }
 
-            can_tx_buf[can_tx_buf_top].cancdmob = cm->dlc & 0x0f;
+    if (bulk_tx.state == CAN_BULK_CLOSED)
+        return;
+    if ((uint8_t)(can_ticks - bulk_tx.tick) >= CAN_BULK_TIMEOUT) {
+        bulk_tx.tick = can_ticks;
+        if (bulk_tx.state == CAN_BULK_OPEN && bulk_tx.base == bulk_tx.next) {
+            bulk_tx.retries = 0; // nothing waits for the receiver
+        }
+        else if (++bulk_tx.retries > CAN_BULK_RETRIES) {
+            bulk_tx.state = CAN_BULK_CLOSED;
+            return;
+        }
+        if (bulk_tx.state == CAN_BULK_OPENING) {
+            bulk_tx.control = H9MSG_BULK_OPEN;
+        }
+        else if (bulk_tx.state == CAN_BULK_CLOSING && !bulk_tx.count) {
+            bulk_tx.control = H9MSG_BULK_CLOSE;
+        }
+        else if (bulk_tx.base != bulk_tx.next) { // go back, the receiver answers a resent frame with the credit
+            bulk_tx.next = bulk_tx.base;
+            bulk_tx.sent = 0;
+        }
+    }
+    if (bulk_tx.control) {
+        if (!put_bulk_control(bulk_tx.destination_id, bulk_tx.control, bulk_tx.top, 0,
+                              bulk_tx.control == H9MSG_BULK_CLOSE ? 2 : 1))
+            return;
+        bulk_tx.control = 0;
+        bulk_tx.tick = can_ticks;
+    }
+    if (bulk_tx.state == CAN_BULK_OPENING)
+        return;
+
+    while (bulk_seq_diff(bulk_tx.next, bulk_tx.base) < bulk_tx.window) {
+        uint8_t length;
+        if (bulk_tx.next == bulk_tx.top) {
+            uint16_t left = bulk_tx.count - bulk_tx.cut;
+            if (!left)
+                break;
+            length = left > 8 ? 8 : left;
+        }
+        else {
+            length = bulk_tx.frame_length[bulk_tx.next % CAN_BULK_WINDOW_MAX];
+        }
+        uint8_t cangie = can_int_mask();
+        if (tx_free(H9MSG_PRIORITY_LOW) < CAN_BULK_TX_RESERVE + CAN_BUF_HEADER_SIZE + length) {
+            can_int_restore(cangie);
+            break;
+        }
 
-            can_tx_buf_top = tmp_idx;
-            ret = 2;
+        if (bulk_tx.next == bulk_tx.top) {
+            bulk_tx.frame_length[bulk_tx.top % CAN_BULK_WINDOW_MAX] = length;
+            bulk_tx.cut += length;
+            bulk_tx.top = bulk_seq_add(bulk_tx.top, 1);
+        }
+        if (bulk_tx.next == bulk_tx.base)
+            bulk_tx.tick = can_ticks;
+
+        uint8_t top = write_tx_header(H9MSG_PRIORITY_LOW, can_tx_buf_top[H9MSG_PRIORITY_LOW],
+                                      H9MSG_TYPE_NODE_SPECIFIC_BULK1 + bulk_tx.next / 32, bulk_tx.next % 32,
+                                      bulk_tx.destination_id, can_node_id, length);
+        uint16_t pos = bulk_tx.head + bulk_tx.sent;
+        if (pos >= bulk_tx.size)
+            pos -= bulk_tx.size;
+        for (uint8_t idx = 0; idx < length; ++idx) {
+            can_tx_buf[H9MSG_PRIORITY_LOW][top] = bulk_tx.buf[pos];
+            top = (uint8_t)((top + 1) & CAN_TX_BUF_INDEX_MASK);
+            if (++pos == bulk_tx.size)
+                pos = 0;
         }
+        publish_tx(H9MSG_PRIORITY_LOW, top);
+        can_int_restore(cangie);
+
+        bulk_tx.sent += length;
+        bulk_tx.next = bulk_seq_add(bulk_tx.next, 1);
+        bulk_tx.polled = 0;
     }
-    sei();
-    return ret;
+
+    // everything sent, the last frames may be too few for the receiver to answer them on its own
+    if (bulk_tx.next == bulk_tx.top && bulk_tx.cut == bulk_tx.count && bulk_tx.base != bulk_tx.next
+        && !bulk_tx.polled && put_bulk_control(bulk_tx.destination_id, H9MSG_BULK_POLL, 0, 0, 1))
+        bulk_tx.polled = 1;
 }
 
-uint8_t CAN_get_msg(h9msg_t *cm) {
-    if (can_rx_buf_top != can_rx_buf_bottom) {
-        cm->priority = (can_rx_buf[can_rx_buf_bottom].canidt1 >> 7) & 0x01;
-        cm->type = ((can_rx_buf[can_rx_buf_bottom].canidt1 >> 2) & 0x1f);
-        cm->seqnum = ((can_rx_buf[can_rx_buf_bottom].canidt1 << 3) & 0x18) | ((can_rx_buf[can_rx_buf_bottom].canidt2 >> 5) & 0x07);
-        cm->destination_id = ((can_rx_buf[can_rx_buf_bottom].canidt2 << 4) & 0x1f0) | ((can_rx_buf[can_rx_buf_bottom].canidt3 >> 4) & 0x0f);
-        cm->source_id = ((can_rx_buf[can_rx_buf_bottom].canidt3 << 5) & 0x1e0) | ((can_rx_buf[can_rx_buf_bottom].canidt4 >> 3) & 0x1f);
 
-        cm->dlc = can_rx_buf[can_rx_buf_bottom].cancdmob & 0x0f;
-        uint8_t idx = 0;
-        for (; idx < 8; ++idx)
-            cm->data[idx] = can_rx_buf[can_rx_buf_bottom].data[idx];
+uint8_t CAN_get_msg(h9msg_t *cm) {
+    put_tx_segments();
+    put_tx_batch();
+    bulk_pump();
+
+    uint8_t bottom = can_rx_buf_bottom;
+    if (can_rx_buf_top != bottom) {
+        CAN_BARRIER();
+        uint8_t cancdmob = can_rx_buf[bottom];
+        bottom = (uint8_t)((bottom + 1) & CAN_RX_BUF_INDEX_MASK);
+        uint8_t canidt1 = can_rx_buf[bottom];
+        bottom = (uint8_t)((bottom + 1) & CAN_RX_BUF_INDEX_MASK);
+        uint8_t canidt2 = can_rx_buf[bottom];
+        bottom = (uint8_t)((bottom + 1) & CAN_RX_BUF_INDEX_MASK);
+        uint8_t canidt3 = can_rx_buf[bottom];
+        bottom = (uint8_t)((bottom + 1) & CAN_RX_BUF_INDEX_MASK);
+        uint8_t canidt4 = can_rx_buf[bottom];
+        bottom = (uint8_t)((bottom + 1) & CAN_RX_BUF_INDEX_MASK);
+
+        cm->priority = (canidt1 >> 7) & 0x01;
+        cm->type = ((canidt1 >> 2) & 0x1f);
+        cm->seqnum = ((canidt1 << 3) & 0x18) | ((canidt2 >> 5) & 0x07);
+        cm->destination_id = ((canidt2 << 4) & 0x1f0) | ((canidt3 >> 4) & 0x0f);
+        cm->source_id = ((canidt3 << 5) & 0x1e0) | ((canidt4 >> 3) & 0x1f);
+
+        cm->dlc = cancdmob & 0x0f;
+        uint8_t payload = CAN_BUF_PAYLOAD(cancdmob);
+        for (uint8_t idx = 0; idx < payload; ++idx) {
+            cm->data[idx] = can_rx_buf[bottom];
+            bottom = (uint8_t)((bottom + 1) & CAN_RX_BUF_INDEX_MASK);
+        }
 
-        can_rx_buf_bottom = (uint8_t)((can_rx_buf_bottom + 1) & CAN_RX_BUF_INDEX_MASK);
+        CAN_BARRIER();
+        can_rx_buf_bottom = bottom;
 
         // 1st msg filter: mob filter/mask
         // 2nd msg filter
@@ -502,8 +1824,166 @@ uint8_t CAN_get_msg(h9msg_t *cm) {
 }
 
 
+void CAN_set_frame_handler(can_frame_handler_t handler) {
+    frame_handler = handler;
+}
+
+
+uint8_t CAN_dispatch(void) {
+    put_tx_segments();
+    put_tx_batch();
+    bulk_pump();
+
+    can_frame_t frame;
+    frame.head = can_rx_buf_bottom;
+    if (can_rx_buf_top == frame.head)
+        return 0;
+    CAN_BARRIER();
+
+    uint8_t kind = frame_kind(&frame);
+    if (!kind) {
+        h9msg_t cm;
+        CAN_get_msg(&cm); // the driver's own frame
+        return 1;
+    }
+
+    if (frame_handler)
+        frame_handler(&frame, kind);
+    else
+        CAN_STAT_INC(can_stats.rx_unhandled);
+
+    CAN_BARRIER();
+    can_rx_buf_bottom = (uint8_t)((frame.head + CAN_BUF_HEADER_SIZE + CAN_BUF_PAYLOAD(can_rx_buf[frame.head])) & CAN_RX_BUF_INDEX_MASK);
+    return 1;
+}
+
+
+// the CAN_get_msg return value for the frame, 0 when the driver processes or drops it (see process_msg)
+uint8_t frame_kind(const can_frame_t *frame) {
+    uint8_t canidt1 = rx_byte(frame, 1);
+    uint8_t canidt2 = rx_byte(frame, 2);
+    uint8_t canidt3 = rx_byte(frame, 3);
+    uint8_t canidt4 = rx_byte(frame, 4);
+    uint16_t source_id = ((canidt3 << 5) & 0x1e0) | ((canidt4 >> 3) & 0x1f);
+    if (source_id == H9MSG_BROADCAST_ID)
+        return 0;
+
+    uint8_t type = (canidt1 >> 2) & 0x1f;
+    uint16_t destination_id = ((canidt2 << 4) & 0x1f0) | ((canidt3 >> 4) & 0x0f);
+    if ((type & H9MSG_NODE_STANDARD_MSG_BROADCAST_SUBGROUP_MASK) == H9MSG_NODE_STANDARD_MSG_BROADCAST_SUBGROUP)
+        return 0;
+    if ((type & H9MSG_NODE_STANDARD_MSG_GROUP_MASK) == H9MSG_NODE_STANDARD_MSG_GROUP) {
+        if (destination_id != can_node_id || reg_table)
+            return 0;
+        uint8_t dlc = CAN_frame_dlc(frame);
+        if ((type == H9MSG_TYPE_SET_REG && dlc > 1) || (type == H9MSG_TYPE_GET_REG && dlc == 1))
+            return CAN_frame_data(frame, 0) >= CAN_FIRST_APP_REGISTER;
+        if ((type == H9MSG_TYPE_SET_BIT || type == H9MSG_TYPE_CLEAR_BIT || type == H9MSG_TYPE_TOGGLE_BIT) && dlc == 2)
+            return 1;
+        return 0;
+    }
+    if ((type & H9MSG_NODE_SPECIFIC_BULK_MSG_GROUP_MASK) == H9MSG_NODE_SPECIFIC_BULK_MSG_GROUP
+        && destination_id == can_node_id)
+        return 0;
+    if ((type & H9MSG_NODE_ALL_REMOTE_MSG_GROUP_MASK) == H9MSG_NODE_ALL_REMOTE_MSG_GROUP)
+        return remote_subscribed(source_id, type) ? 2 : 0;
+    return 0;
+}
+
+
+uint8_t rx_byte(const can_frame_t *frame, uint8_t offset) {
+    return can_rx_buf[(uint8_t)((frame->head + offset) & CAN_RX_BUF_INDEX_MASK)];
+}
+
+
+uint8_t CAN_frame_priority(const can_frame_t *frame) {
+    return (rx_byte(frame, 1) >> 7) & 0x01;
+}
+
+
+uint8_t CAN_frame_type(const can_frame_t *frame) {
+    return (rx_byte(frame, 1) >> 2) & 0x1f;
+}
+
+
+uint8_t CAN_frame_seqnum(const can_frame_t *frame) {
+    return ((rx_byte(frame, 1) << 3) & 0x18) | ((rx_byte(frame, 2) >> 5) & 0x07);
+}
+
+
+uint16_t CAN_frame_destination_id(const can_frame_t *frame) {
+    return ((rx_byte(frame, 2) << 4) & 0x1f0) | ((rx_byte(frame, 3) >> 4) & 0x0f);
+}
+
+
+uint16_t CAN_frame_source_id(const can_frame_t *frame) {
+    return ((rx_byte(frame, 3) << 5) & 0x1e0) | ((rx_byte(frame, 4) >> 3) & 0x1f);
+}
+
+
+uint8_t CAN_frame_dlc(const can_frame_t *frame) {
+    return rx_byte(frame, 0) & 0x0f;
+}
+
+
+uint8_t CAN_frame_data(const can_frame_t *frame, uint8_t idx) {
+    return rx_byte(frame, CAN_BUF_HEADER_SIZE + idx);
+}
+
+
+void CAN_get_stats(can_stats_t *stats) {
+    uint8_t cangie = can_int_mask();
+    *stats = can_stats;
+    stats->tec = CANTEC;
+    stats->rec = CANREC;
+    uint8_t cangsta = CANGSTA;
+    stats->error_state = (cangsta & (1 << ERRP) ? CAN_ERROR_PASSIVE : 0)
+                         | (cangsta & (1 << BOFF) ? CAN_ERROR_BUS_OFF : 0)
+                         | (bus_off_hold ? CAN_ERROR_TX_HELD : 0);
+    can_int_restore(cangie);
+}
+
+
+void CAN_clear_stats(void) {
+    uint8_t cangie = can_int_mask();
+    memset(&can_stats, 0, sizeof(can_stats));
+    can_int_restore(cangie);
+}
+
+
+// NODE_CAN_STATS_STD_REGISTER or NODE_CAN_ERRORS_STD_REGISTER value, the 16-bit counters squeezed into bytes
+uint8_t stats_reg_value(uint8_t reg, uint8_t *value) {
+    can_stats_t stats;
+    CAN_get_stats(&stats);
+    if (reg == NODE_CAN_STATS_STD_REGISTER) {
+        value[0] = (stats.rx_frames >> 8) & 0xff;
+        value[1] = stats.rx_frames & 0xff;
+        value[2] = (stats.tx_frames >> 8) & 0xff;
+        value[3] = stats.tx_frames & 0xff;
+        value[4] = CAN_STATS_SATURATE(stats.rx_overruns);
+        value[5] = CAN_STATS_SATURATE(stats.tx_drops);
+        // high-water marks in 1/16 of the rx ring and 1/8 of a tx ring
+        uint8_t rx_level = (uint16_t)stats.rx_high_water * 16 / CAN_RX_BUF_SIZE;
+        uint8_t tx_level = (uint16_t)stats.tx_high_water * 8 / CAN_TX_BUF_SIZE;
+        value[6] = (rx_level << 4) | (tx_level << 1) | (stats.error_interrupts ? 1 : 0);
+        return CAN_STATS_REG_SIZE;
+    }
+    value[0] = stats.tec;
+    value[1] = stats.rec;
+    value[2] = stats.error_state;
+    value[3] = CAN_STATS_SATURATE(stats.bus_offs);
+    value[4] = CAN_STATS_SATURATE(stats.bit_errors);
+    value[5] = CAN_STATS_SATURATE(stats.stuff_errors);
+    value[6] = CAN_STATS_SATURATE(stats.crc_errors);
+    value[7] = CAN_STATS_SATURATE(stats.form_errors);
+    value[8] = CAN_STATS_SATURATE(stats.ack_errors);
+    value[9] = CAN_STATS_SATURATE(stats.error_interrupts);
+    value[10] = CAN_STATS_SATURATE(stats.rx_unhandled);
+    return CAN_ERRORS_REG_SIZE;
+}
+
+
 void CAN_init_new_msg(h9msg_t *mes) {
-    static uint8_t next_seqnum = 0;
     mes->priority = H9MSG_PRIORITY_LOW;
     mes->seqnum = next_seqnum;
     mes->source_id = can_node_id;
@@ -515,23 +1995,26 @@ void CAN_init_new_msg(h9msg_t *mes) {
 void CAN_init_response_msg(const h9msg_t *req, h9msg_t *res) {
     res->priority = req->priority;
     res->seqnum = req->seqnum;
-    switch (req->type) {
+    res->type = response_type(req->type);
+    res->source_id = can_node_id;
+    res->destination_id = req->source_id;
+    res->dlc = 0;
+}
+
+
+uint8_t response_type(uint8_t request_type) {
+    switch (request_type) {
         case H9MSG_TYPE_GET_REG:
-            res->type = H9MSG_TYPE_REG_VALUE;
-            break;
+            return H9MSG_TYPE_REG_VALUE;
         case H9MSG_TYPE_SET_REG:
         case H9MSG_TYPE_SET_BIT:
         case H9MSG_TYPE_CLEAR_BIT:
         case H9MSG_TYPE_TOGGLE_BIT:
-            res->type = H9MSG_TYPE_REG_EXTERNALLY_CHANGED;
-            break;
+            return H9MSG_TYPE_REG_EXTERNALLY_CHANGED;
         case H9MSG_TYPE_DISCOVER:
-            res->type = H9MSG_TYPE_NODE_INFO;
-            break;
+            return H9MSG_TYPE_NODE_INFO;
     }
-    res->source_id = can_node_id;
-    res->destination_id = req->source_id;
-    res->dlc = 0;
+    return request_type;
 }
 
 
@@ -547,9 +2030,11 @@ void read_node_id(void) {
 
 
 void write_node_id(uint16_t id) {
-    cli();
-    eeprom_write_word(&ee_node_id, id);
-    sei();
+    if (!PERSIST_write_word(&ee_node_id, id)) {
+        // queue full of application settings, the node id must not get lost
+        PERSIST_flush();
+        PERSIST_write_word(&ee_node_id, id);
+    }
 }
 
 static uint8_t calc_can_id1(uint8_t priority, uint8_t type, uint8_t seqnum, uint16_t destination_id, uint16_t source_id) {
@@ -0,0 +1,130 @@
+// SPDX-License-Identifier: MIT
+/*
+ * H9 CAN non-blocking EEPROM writes for AVR
+ *
+ * Copyright (C) 2024 Kamil Pałkowski
+ *
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "avr/persist.h"
+
+// at90can128 names
+#if !defined(EEPE) && defined(EEWE)
+#define EEPE EEWE
+#define EEMPE EEMWE
+#endif
+
+static struct {
+    uint8_t *address;
+    uint8_t value;
+} persist_queue[PERSIST_QUEUE_SIZE];
+// the main context changes the queue with EERIE cleared, EE_READY_vect runs only with EERIE set
+static volatile uint8_t persist_head;
+static volatile uint8_t persist_count;
+
+static int8_t find_queued(uint8_t *address);
+static uint8_t write_next(void);
+
+
+ISR(EE_READY_vect) {
+    if (!write_next())
+        EECR &= ~(1 << EERIE);
+}
+
+
+uint8_t PERSIST_write_byte(uint8_t *address, uint8_t value) {
+    return PERSIST_write_block(address, &value, 1);
+}
+
+
+uint8_t PERSIST_write_word(uint16_t *address, uint16_t value) {
+    return PERSIST_write_block(address, &value, 2);
+}
+
+
+uint8_t PERSIST_write_block(void *address, const void *src, uint8_t size) {
+    uint8_t *first = address;
+    const uint8_t *value = src;
+
+    EECR &= ~(1 << EERIE);
+    uint8_t needed = 0;
+    for (uint8_t i = 0; i < size; ++i) {
+        if (find_queued(first + i) < 0)
+            ++needed;
+    }
+
+    uint8_t ret = 0;
+    if (persist_count + needed <= PERSIST_QUEUE_SIZE) {
+        for (uint8_t i = 0; i < size; ++i) {
+            int8_t idx = find_queued(first + i);
+            if (idx < 0) {
+                idx = (persist_head + persist_count) % PERSIST_QUEUE_SIZE;
+                persist_queue[idx].address = first + i;
+                ++persist_count;
+            }
+            persist_queue[idx].value = value[i];
+        }
+        ret = 1;
+    }
+
+    if (persist_count)
+        EECR |= 1 << EERIE;
+    return ret;
+}
+
+
+uint8_t PERSIST_busy(void) {
+    return persist_count || (EECR & (1 << EEPE));
+}
+
+
+void PERSIST_flush(void) {
+    EECR &= ~(1 << EERIE);
+    do {
+        while (EECR & (1 << EEPE));
+    } while (write_next());
+    while (EECR & (1 << EEPE));
+}
+
+
+// @return queue index of the address, -1 - not queued
+int8_t find_queued(uint8_t *address) {
+    for (uint8_t i = 0; i < persist_count; ++i) {
+        uint8_t idx = (persist_head + i) % PERSIST_QUEUE_SIZE;
+        if (persist_queue[idx].address == address)
+            return idx;
+    }
+    return -1;
+}
+
+
+/*
+ * Starts the write of the first queued byte that differs from the EEPROM, with the EEPROM idle and EERIE
+ * cleared or from EE_READY_vect.
+ * @return 0 - the queue is empty
+ */
+uint8_t write_next(void) {
+    while (persist_count) {
+        uint8_t *address = persist_queue[persist_head].address;
+        uint8_t value = persist_queue[persist_head].value;
+        persist_head = (persist_head + 1) % PERSIST_QUEUE_SIZE;
+        --persist_count;
+
+        EEAR = (uintptr_t)address;
+        EECR |= 1 << EERE;
+        if (EEDR == value)
+            continue;
+
+        EEDR = value;
+        uint8_t sreg = SREG;
+        cli();
+        EECR |= 1 << EEMPE; // EEPE has to follow within 4 cycles
+        EECR |= 1 << EEPE;
+        SREG = sreg;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,61 @@
+// SPDX-License-Identifier: MIT
+/*
+ * H9 CAN cycle benchmark - protocol between the benchmark firmware and the simulator
+ *
+ * Copyright (C) 2024 Kamil Pałkowski
+ *
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+/*
+ * The simulator stubs the whole CAN register block (0xd8 - 0xfa, the same on the ATmegaxxM1/C1
+ * and AT90CAN128). The time-trigger registers and CANIE1 are not used by h9can, so they carry
+ * the benchmark markers and the commands for the stubbed controller.
+ */
+#define BENCH_MARK_ADDR 0xe8    // CANTTCL: write a benchmark id to start, 0 to stop
+#define BENCH_CMD_ADDR 0xe9     // CANTTCH: BENCH_CMD_*
+#define BENCH_VECTOR_ADDR 0xdf  // CANIE1: CAN_INT_vect number, 0 for the polled bootloader driver
+
+#define BENCH_CMD_NOP 0x00
+#define BENCH_CMD_INJECT 0x10       // | MOb number: the frame prepared in the (disabled) MOb arrives from the bus
+#define BENCH_CMD_TX_DONE 0x20      // all pending tx MObs finish with TXOK
+#define BENCH_CMD_FLASH_HOST 0x30   // tx completes at once and PAGE_FILL_NEXT is answered with PAGE_FILL
+#define BENCH_CMD_EXIT 0xff
+
+#define BENCH_SAMPLES 8
+#define BENCH_HOST_ID 0x001
+
+#define BENCH_LIST(X) \
+    X(BENCH_EMPTY, 1, "empty") \
+    X(BENCH_ISR_RX, 2, "CAN_INT_vect rx") \
+    X(BENCH_ISR_TX, 3, "CAN_INT_vect tx") \
+    X(BENCH_ISR_TX_REFILL, 4, "CAN_INT_vect tx refill") \
+    X(BENCH_PUT_MSG_DIRECT, 5, "CAN_put_msg direct") \
+    X(BENCH_PUT_MSG_QUEUED, 6, "CAN_put_msg queued") \
+    X(BENCH_GET_MSG_PROCESS, 7, "CAN_get_msg + process_msg") \
+    X(BENCH_WRITE_PAGE, 8, "bootloader write_page")
+
+#define BENCH_ENUM(name, id, label) name = id,
+enum {
+    BENCH_LIST(BENCH_ENUM)
+};
+#undef BENCH_ENUM
+
+#ifdef __AVR_ARCH__
+#include <avr/io.h>
+
+#define BENCH_REG(addr) _SFR_MEM8(addr)
+#define BENCH_BEGIN(id) BENCH_REG(BENCH_MARK_ADDR) = (id)
+#define BENCH_END() BENCH_REG(BENCH_MARK_ADDR) = 0
+#define BENCH_CMD(cmd) BENCH_REG(BENCH_CMD_ADDR) = (cmd)
+
+#if defined (__AVR_AT90CAN128__)
+#  define BENCH_CAN_VECTOR CANIT_vect_num
+#else
+#  define BENCH_CAN_VECTOR CAN_INT_vect_num
+#endif
+#endif //__AVR_ARCH__
+
+#endif //_BENCH_H_
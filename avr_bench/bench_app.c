@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: MIT
+/*
+ * H9 CAN cycle benchmark - application driver paths
+ *
+ * Copyright (C) 2024 Kamil Pałkowski
+ *
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+#include <h9def.h>
+
+#include "avr/can.h"
+#include "bench.h"
+
+#define SCRATCH_MOB 5 // a tx MOb, idle whenever a frame is injected
+
+static void inject(uint8_t type, uint16_t destination_id, uint8_t dlc, uint8_t data0) {
+    uint8_t savecanpage = CANPAGE;
+    CANPAGE = SCRATCH_MOB << MOBNB0;
+    CANIDT1 = ((H9MSG_PRIORITY_LOW << 7) & 0x80) | ((type << 2) & 0x7c);
+    CANIDT2 = (destination_id >> 4) & 0x1f;
+    CANIDT3 = ((destination_id << 4) & 0xf0) | ((BENCH_HOST_ID >> 5) & 0x0f);
+    CANIDT4 = (BENCH_HOST_ID << 3) & 0xf8;
+    CANMSG = data0;
+    CANCDMOB = dlc;
+    CANPAGE = savecanpage;
+    BENCH_CMD(BENCH_CMD_INJECT | SCRATCH_MOB);
+}
+
+
+static void drain(void) {
+    h9msg_t cm;
+    while (CAN_get_msg(&cm));
+    for (uint8_t i = 0; i < 16; ++i)
+        BENCH_CMD(BENCH_CMD_TX_DONE);
+}
+
+
+static void init_msg(h9msg_t *cm) {
+    CAN_init_new_msg(cm);
+    cm->type = H9MSG_TYPE_REG_INTERNALLY_CHANGED;
+    cm->destination_id = H9MSG_BROADCAST_ID;
+    cm->dlc = 3;
+    cm->data[0] = 10;
+    cm->data[1] = 0x12;
+    cm->data[2] = 0x34;
+}
+
+
+int main(void) {
+    BENCH_REG(BENCH_VECTOR_ADDR) = BENCH_CAN_VECTOR;
+
+    CAN_init(0x0101, 'a', 1, 0, "bench");
+    sei();
+
+    h9msg_t cm;
+    for (uint8_t i = 0; i < BENCH_SAMPLES; ++i) {
+        BENCH_BEGIN(BENCH_EMPTY);
+        BENCH_CMD(BENCH_CMD_NOP);
+        BENCH_END();
+
+        inject(H9MSG_TYPE_DISCOVER, H9MSG_BROADCAST_ID, 0, 0);
+        drain();
+
+        BENCH_BEGIN(BENCH_ISR_RX);
+        inject(H9MSG_TYPE_GET_REG, can_node_id, 1, NODE_ID_STD_REGISTER);
+        BENCH_END();
+        drain();
+
+        init_msg(&cm);
+        CAN_put_msg(&cm);
+        BENCH_BEGIN(BENCH_ISR_TX);
+        BENCH_CMD(BENCH_CMD_TX_DONE);
+        BENCH_END();
+        drain();
+
+        while (CAN_put_msg(&cm) == 1); // all tx MObs busy, one frame queued
+        BENCH_BEGIN(BENCH_ISR_TX_REFILL);
+        BENCH_CMD(BENCH_CMD_TX_DONE);
+        BENCH_END();
+        drain();
+
+        BENCH_BEGIN(BENCH_PUT_MSG_DIRECT);
+        CAN_put_msg(&cm);
+        BENCH_END();
+        drain();
+
+        while (CAN_put_msg(&cm) == 1);
+        BENCH_BEGIN(BENCH_PUT_MSG_QUEUED);
+        CAN_put_msg(&cm);
+        BENCH_END();
+        drain();
+
+        inject(H9MSG_TYPE_GET_REG, can_node_id, 1, NODE_VERSION_STD_REGISTER);
+        BENCH_BEGIN(BENCH_GET_MSG_PROCESS);
+        CAN_get_msg(&cm);
+        BENCH_END();
+        drain();
+    }
+
+    BENCH_CMD(BENCH_CMD_EXIT);
+    cli();
+    sleep_cpu();
+    for (;;);
+}
@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: MIT
+/*
+ * H9 CAN cycle benchmark - bootloader page write
+ *
+ * Copyright (C) 2024 Kamil Pałkowski
+ *
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+#include "../avr_bootloader/can.h"
+#include "bench.h"
+
+// far away from the benchmark image itself
+#define BENCH_PAGE ((FLASHEND + 1UL) / SPM_PAGESIZE / 2)
+
+uint8_t write_page(uint16_t page, uint16_t dst_id, uint8_t flags, uint8_t frames);
+
+int main(void) {
+    BENCH_REG(BENCH_VECTOR_ADDR) = 0;
+
+    CAN_init();
+    BENCH_CMD(BENCH_CMD_FLASH_HOST);
+
+    for (uint8_t i = 0; i < BENCH_SAMPLES; ++i) {
+        BENCH_BEGIN(BENCH_EMPTY);
+        BENCH_CMD(BENCH_CMD_NOP);
+        BENCH_END();
+
+        h9msg_t cm;
+        cm.type = H9MSG_TYPE_PAGE_FILL_NEXT;
+        cm.priority = H9MSG_PRIORITY_HIGH;
+        cm.source_id = can_node_id;
+        cm.destination_id = BENCH_HOST_ID;
+        cm.seqnum = i;
+        cm.dlc = 2;
+        cm.data[0] = (SPM_PAGESIZE >> 8) & 0xff;
+        cm.data[1] = (SPM_PAGESIZE) & 0xff;
+        CAN_put_msg_blocking(&cm);
+
+        BENCH_BEGIN(BENCH_WRITE_PAGE);
+        write_page(BENCH_PAGE, BENCH_HOST_ID, 0, SPM_PAGESIZE / 8);
+        BENCH_END();
+    }
+
+    BENCH_CMD(BENCH_CMD_EXIT);
+    cli();
+    sleep_cpu();
+    for (;;);
+}
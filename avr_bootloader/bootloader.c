@@ -11,21 +11,382 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/boot.h>
+#include <avr/pgmspace.h>
+#include <avr/wdt.h>
+#include <util/crc16.h>
 
 #include "../include/h9def.h"
 #include "../include/h9msg.h"
+#include "../include/avr/h9boot.h"
 #include "can.h"
 
+#if defined (__AVR_ATmega16M1__)
+#define NODE_MCU NODE_MCU_ATMEGA16M1
+#elif defined (__AVR_ATmega32M1__)
+#define NODE_MCU NODE_MCU_ATMEGA32M1
+#elif defined (__AVR_ATmega64M1__)
+#define NODE_MCU NODE_MCU_ATMEGA64M1
+#elif defined (__AVR_AT90CAN128__)
+#define NODE_MCU NODE_MCU_AT90CAN128
+#elif defined (__AVR_ATmega32C1__)
+#define NODE_MCU NODE_MCU_ATMEGA32C1
+#else
+#error "Unsupported MCU"
+#endif
+
+#if F_CPU == 2000000UL
+#define NODE_MCU_F NODE_MCU_F_2MHz
+#elif F_CPU == 4000000UL
+#define NODE_MCU_F NODE_MCU_F_4MHz
+#elif F_CPU == 6000000UL
+#define NODE_MCU_F NODE_MCU_F_6MHz
+#elif F_CPU == 8000000UL
+#define NODE_MCU_F NODE_MCU_F_8MHz
+#elif F_CPU == 12000000UL
+#define NODE_MCU_F NODE_MCU_F_12MHz
+#elif F_CPU == 16000000UL
+#define NODE_MCU_F NODE_MCU_F_16MHz
+#else
+#error "Please specify F_CPU"
+#endif
+
+#define PAGE_FRAMES (SPM_PAGESIZE / 8)
+#if PAGE_FRAMES > 32
+#error "Page does not fit in 5-bit seqnum"
+#endif
+
+#ifndef BOOTLOADER_STREAM_WINDOW
+#define BOOTLOADER_STREAM_WINDOW PAGE_FRAMES
+#endif
+
+#define STREAM_RX_TIMEOUT (CAN_RX_TIMEOUT >> 4)
+#define STREAM_MAX_NAK 8
+
+#ifdef BOOTLOADER_STREAM
+#define PAGE_FLAG_STREAM H9MSG_PAGE_START_FLAG_STREAM
+#else
+#define PAGE_FLAG_STREAM 0
+#endif
+#ifdef BOOTLOADER_VERIFY
+#define PAGE_FLAG_VERIFY H9MSG_PAGE_START_FLAG_VERIFY
+#else
+#define PAGE_FLAG_VERIFY 0
+#endif
+// PAGE_START with any other flag is ignored, the host falls back to the plain transfer
+#ifdef BOOTLOADER_COMPRESS
+#define PAGE_FLAG_COMPRESSED H9MSG_PAGE_START_FLAG_COMPRESSED
+#else
+#define PAGE_FLAG_COMPRESSED 0
+#endif
+#define PAGE_FLAGS_SUPPORTED (PAGE_FLAG_STREAM | PAGE_FLAG_VERIFY | PAGE_FLAG_COMPRESSED)
+
 static uint8_t seqnum = 0;
 
-void write_page(uint16_t page, uint16_t dst_id) {
-    uint16_t bytes_remain = SPM_PAGESIZE;
+static uint8_t page_buf[SPM_PAGESIZE];
+#ifdef BOOTLOADER_COMPRESS
+// PAGE_FILL payload of a compressed page, expanded into page_buf when complete
+static uint8_t pack_buf[SPM_PAGESIZE];
+#define RX_BUF(flags) ((flags) & H9MSG_PAGE_START_FLAG_COMPRESSED ? pack_buf : page_buf)
+#else
+#define RX_BUF(flags) page_buf
+#endif
+static uint16_t erase_address;
+static uint8_t erase_pending;
+
+#define PAGE_COUNT (((uint32_t)FLASHEND + 1) / SPM_PAGESIZE)
+
+#if defined(BOOTLOADER_VERIFY) || defined(BOOTLOADER_FASTBOOT)
+#define FLASH_CRC
+#endif
+
+#ifdef BOOTLOADER_FASTBOOT
+static uint8_t upgrade_request __attribute__ ((section (".noinit")));
+static uint16_t app_pages;
+static uint8_t app_modified;
+#endif
+
+#ifdef BOOTLOADER_MULTICAST
+static uint16_t multicast_host;
+static uint8_t page_received[PAGE_COUNT / 8];
+#endif
+
+#ifdef BOOTLOADER_BITRATE_SWITCH
+static uint8_t fast_bitrate;
+#endif
+
+/*
+ * Flash access is pipelined: a page erase is issued as soon as SPM is free, the page data is
+ * collected in page_buf in the meantime, and the page write does not wait for completion.
+ * flash_sync() has to be called before the RWW section is read or the application is started.
+ */
+static void flash_poll(void) {
+    if (erase_pending && !boot_spm_busy()) {
+        boot_page_erase(erase_address);
+        erase_pending = 0;
+    }
+}
+
+
+static void flash_sync(void) {
+    boot_spm_busy_wait();
+    flash_poll();
+    boot_spm_busy_wait();
+    boot_rww_enable();
+}
+
+
+static void schedule_erase(uint16_t address) {
+    erase_address = address;
+    erase_pending = 1;
+    flash_poll();
+}
+
+
+#ifdef BOOTLOADER_FASTBOOT
+/*
+ * Latched before the stack is used, the request word lies at the top of RAM. A jump from an older
+ * application (MCUSR cleared by it, no request word) counts as a request too, any reset does not.
+ */
+__attribute__((naked)) __attribute__((section(".init3"))) void upgrade_request_latch(void) {
+    upgrade_request = MCUSR == 0 || *H9BOOT_UPGRADE_REQUEST == H9BOOT_UPGRADE_MAGIC;
+    *H9BOOT_UPGRADE_REQUEST = 0;
+}
+#endif
+
+
+#ifdef FLASH_CRC
+static uint8_t flash_read(uint32_t address) {
+#if FLASHEND > 0xffff
+    return pgm_read_byte_far(address);
+#else
+    return pgm_read_byte((uint16_t)address);
+#endif
+}
+
+
+static uint16_t flash_crc(uint16_t first_page, uint16_t pages) {
+    uint32_t address = (uint32_t)first_page * SPM_PAGESIZE;
+    uint32_t end = address + (uint32_t)pages * SPM_PAGESIZE;
+    if (end > (uint32_t)FLASHEND + 1)
+        end = (uint32_t)FLASHEND + 1;
+
+    flash_sync();
+    uint16_t crc = 0;
+    for (; address < end; ++address) {
+        if (!(address & (SPM_PAGESIZE - 1)))
+            wdt_reset(); // the whole application takes longer than the shortest watchdog timeout
+        crc = _crc_xmodem_update(crc, flash_read(address));
+    }
+    return crc;
+}
+#endif //FLASH_CRC
+
+
+#ifdef BOOTLOADER_VERIFY
+static uint8_t page_unchanged(uint16_t address) {
+    flash_sync();
+    for (uint16_t i = 0; i < SPM_PAGESIZE; ++i) {
+        if (flash_read((uint32_t)address + i) != page_buf[i])
+            return 0;
+    }
+    return 1;
+}
+#endif //BOOTLOADER_VERIFY
+
+#ifdef BOOTLOADER_COMPRESS
+/*
+ * PackBits: a header byte n in 0..127 is followed by n + 1 literal bytes, n in -127..-1 by one byte
+ * repeated 1 - n times, -128 is skipped. The bytes after a complete page are padding.
+ * @retval 0 - corrupt stream
+ */
+static uint8_t unpack_page(uint8_t frames) {
+    uint16_t in = 0;
+    uint16_t in_end = frames * 8;
+    uint16_t out = 0;
+    while (out < SPM_PAGESIZE) {
+        if (in >= in_end)
+            return 0;
+        uint8_t n = pack_buf[in++];
+        if (n < 0x80) {
+            uint8_t count = n + 1;
+            if (out + count > SPM_PAGESIZE || in + count > in_end)
+                return 0;
+            while (count--)
+                page_buf[out++] = pack_buf[in++];
+        }
+        else if (n > 0x80) {
+            uint8_t count = 257 - n;
+            if (out + count > SPM_PAGESIZE || in >= in_end)
+                return 0;
+            uint8_t b = pack_buf[in++];
+            while (count--)
+                page_buf[out++] = b;
+        }
+    }
+    return 1;
+}
+#endif //BOOTLOADER_COMPRESS
+
+
+/*
+ * Number of PAGE_FILL frames announced by PAGE_START: data[3] for a compressed page, a whole page otherwise.
+ * @retval 0 - not a PAGE_START or not supported flags
+ */
+static uint8_t page_start_frames(const h9msg_t *cm, uint8_t supported_flags) {
+    if (cm->type != H9MSG_TYPE_PAGE_START)
+        return 0;
+    if (cm->dlc == 2)
+        return PAGE_FRAMES;
+    if (cm->dlc < 3 || cm->dlc > 4 || (cm->data[2] & ~supported_flags))
+        return 0;
+#ifdef BOOTLOADER_COMPRESS
+    if (cm->data[2] & H9MSG_PAGE_START_FLAG_COMPRESSED)
+        return cm->dlc == 4 && cm->data[3] <= PAGE_FRAMES ? cm->data[3] : 0;
+#endif
+    return PAGE_FRAMES;
+}
+
+
+/*
+ * In the verify mode the erase is not scheduled at the page start, the page is erased
+ * and written only if page_buf differs from the flash content.
+ * @retval 0 - page unchanged, nothing written
+ * @retval 1 - page write started
+ */
+static uint8_t commit_page(uint16_t address, uint8_t flags) {
+#ifdef BOOTLOADER_MULTICAST
+    uint16_t page = address / SPM_PAGESIZE;
+    page_received[page >> 3] |= 1 << (page & 0x07);
+#endif
+#ifdef BOOTLOADER_VERIFY
+    if (flags & H9MSG_PAGE_START_FLAG_VERIFY) {
+        if (page_unchanged(address))
+            return 0;
+        schedule_erase(address);
+    }
+#endif
+    boot_spm_busy_wait();
+    flash_poll();
+    boot_spm_busy_wait();
+#ifdef BOOTLOADER_FASTBOOT
+    // the stored CRC is invalid until the session ends with QUIT_BOOTLOADER
+    if (!app_modified) {
+        app_modified = 1;
+        eeprom_write_word(H9BOOT_EE_APP_PAGES, 0xffff);
+        eeprom_busy_wait();
+    }
+    if (address / SPM_PAGESIZE >= app_pages)
+        app_pages = address / SPM_PAGESIZE + 1;
+#endif
+    for (uint16_t i = 0; i < SPM_PAGESIZE; i += 2) {
+        uint16_t w = page_buf[i + 1] << 8;
+        w |= page_buf[i];
+        boot_page_fill(address + i, w);
+    }
+    boot_page_write(address);
+    return 1;
+}
+
+
+static void finish_page(uint16_t address, uint16_t dst_id, uint8_t res_seqnum, uint8_t flags, uint8_t frames) {
+    h9msg_t cm_res;
+    cm_res.type = H9MSG_TYPE_PAGE_WRITED;
+    cm_res.priority = H9MSG_PRIORITY_HIGH;
+    cm_res.source_id = can_node_id;
+    cm_res.destination_id = dst_id;
+    cm_res.seqnum = res_seqnum;
+    cm_res.dlc = 2;
+    cm_res.data[0] = (address >> 8) & 0xff;
+    cm_res.data[1] = (address) & 0xff;
+
+#ifdef BOOTLOADER_COMPRESS
+    if ((flags & H9MSG_PAGE_START_FLAG_COMPRESSED) && !unpack_page(frames)) {
+        cm_res.type = H9MSG_TYPE_PAGE_FILL_BREAK;
+        cm_res.dlc = 0;
+        CAN_put_msg_blocking(&cm_res);
+        return;
+    }
+#endif
+    uint8_t written = commit_page(address, flags);
+    if (flags & H9MSG_PAGE_START_FLAG_VERIFY) {
+        cm_res.dlc = 3;
+        cm_res.data[2] = written ? 0 : H9MSG_PAGE_WRITED_FLAG_UNCHANGED;
+    }
+
+    CAN_put_msg_blocking(&cm_res);
+}
+
+
+#ifdef BOOTLOADER_FASTBOOT
+static uint16_t read_app_pages(void) {
+    uint16_t pages = eeprom_read_word(H9BOOT_EE_APP_PAGES);
+    return pages > 0 && pages < PAGE_COUNT ? pages : 0;
+}
+
+
+static uint8_t app_valid(void) {
+    uint16_t pages = read_app_pages();
+    return pages && flash_crc(0, pages) == eeprom_read_word(H9BOOT_EE_APP_CRC);
+}
+
+
+static void store_app_crc(void) {
+    eeprom_write_word(H9BOOT_EE_APP_CRC, flash_crc(0, app_pages));
+    eeprom_write_word(H9BOOT_EE_APP_PAGES, app_pages);
+    eeprom_busy_wait();
+}
+#endif
+
+
+static void start_application(void) {
+    flash_sync();
+#ifdef BOOTLOADER_FASTBOOT
+    if (app_modified)
+        store_app_crc();
+#endif
+    MCUCR &= ~(1 << IVSEL);
+    asm volatile ("jmp  0x0000");
+}
+
+
+// answers a NOP command in place, data[0] keeps the command
+static void send_command_response(h9msg_t *cm, uint8_t dlc) {
+    cm->priority = H9MSG_PRIORITY_HIGH;
+    cm->destination_id = cm->source_id;
+    cm->source_id = can_node_id;
+    cm->dlc = dlc;
+    CAN_put_msg_blocking(cm);
+}
+
+
+static uint8_t receive(h9msg_t *cm, uint32_t timeout) {
+    while (timeout) {
+        wdt_reset();
+        flash_poll();
+        if (CAN_get_msg(cm))
+            return 1;
+        --timeout;
+    }
+    return 0;
+}
+
+
+/*
+ * @retval 0 - the host sent nothing for CAN_RX_TIMEOUT, the page is given up
+ * @retval 1 - the page is written or broken off by the host
+ */
+uint8_t write_page(uint16_t page, uint16_t dst_id, uint8_t flags, uint8_t frames) {
+    uint8_t *rx_buf = RX_BUF(flags);
+    uint16_t bytes = frames * 8;
+    uint16_t bytes_remain = bytes;
     page = page * SPM_PAGESIZE;
 
-    boot_page_erase_safe(page);
+    if (!(flags & H9MSG_PAGE_START_FLAG_VERIFY))
+        schedule_erase(page);
     while (1) {
         h9msg_t cm;
-        CAN_get_msg_blocking(&cm);
+        if (!receive(&cm, CAN_RX_TIMEOUT))
+            return 0;
 
         h9msg_t cm_res;
 
@@ -35,62 +396,260 @@ void write_page(uint16_t page, uint16_t dst_id) {
         cm_res.seqnum = cm.seqnum;
 
         if (cm.source_id == dst_id && cm.type == H9MSG_TYPE_PAGE_FILL && cm.dlc == 8) {
-            uint16_t w = cm.data[1] << 8;
-            w |= cm.data[0];
-
-            boot_page_fill_safe(page + (SPM_PAGESIZE-bytes_remain), w);
-            bytes_remain -= 2;
+            uint8_t *dst = rx_buf + (bytes - bytes_remain);
+            for (uint8_t i = 0; i < 8; ++i)
+                dst[i] = cm.data[i];
+            bytes_remain -= 8;
 
-            w = cm.data[3] << 8;
-            w |= cm.data[2];
+            if (bytes_remain == 0) {
+                finish_page(page, dst_id, cm.seqnum, flags, frames);
+                return 1;
+            }
+            else {
+                cm_res.type = H9MSG_TYPE_PAGE_FILL_NEXT;
+                cm_res.dlc = 2;
+                cm_res.data[0] = (bytes_remain >> 8) & 0xff;
+                cm_res.data[1] = (bytes_remain) & 0xff;
+                CAN_put_msg_blocking(&cm_res);
+            }
+        }
+        else if (cm.source_id == dst_id && (cm.type & H9MSG_BOOTLOADER_MSG_GROUP_MASK) == H9MSG_BOOTLOADER_MSG_GROUP) {
+            cm_res.type = H9MSG_TYPE_PAGE_FILL_BREAK;
+            cm_res.dlc = 0;
 
-            boot_page_fill_safe(page + (SPM_PAGESIZE-bytes_remain), w);
-            bytes_remain -= 2;
+            CAN_put_msg_blocking(&cm_res);
+            return 1;
+        }
+    }
+}
 
-            w = cm.data[5] << 8;
-            w |= cm.data[4];
+#ifdef BOOTLOADER_STREAM
+/*
+ * Streamed page: the host sends up to `window` PAGE_FILL frames back-to-back, seqnum is the frame
+ * index in the page. The node answers once per window (or after a timeout) with PAGE_FILL_NEXT:
+ * data[0..1] bytes remain, data[2] window, data[3..6] bitmap of the missing frames (bit n - frame n).
+ * The host resends only the missing frames, the last one is confirmed by PAGE_WRITED.
+ */
+static void send_stream_state(uint16_t dst_id, uint32_t missing, uint8_t missing_frames) {
+    h9msg_t cm_res;
+    cm_res.type = H9MSG_TYPE_PAGE_FILL_NEXT;
+    cm_res.priority = H9MSG_PRIORITY_HIGH;
+    cm_res.source_id = can_node_id;
+    cm_res.destination_id = dst_id;
+    cm_res.seqnum = seqnum++;
+    cm_res.dlc = 7;
+    cm_res.data[0] = ((missing_frames * 8) >> 8) & 0xff;
+    cm_res.data[1] = (missing_frames * 8) & 0xff;
+    cm_res.data[2] = BOOTLOADER_STREAM_WINDOW;
+    cm_res.data[3] = (missing >> 24) & 0xff;
+    cm_res.data[4] = (missing >> 16) & 0xff;
+    cm_res.data[5] = (missing >> 8) & 0xff;
+    cm_res.data[6] = (missing) & 0xff;
+    CAN_put_msg_blocking(&cm_res);
+}
 
-            boot_page_fill_safe(page + (SPM_PAGESIZE-bytes_remain), w);
-            bytes_remain -= 2;
 
-            w = cm.data[7] << 8;
-            w |= cm.data[6];
+// @return as write_page, the host is gone after STREAM_MAX_NAK answers in a row with nothing received
+uint8_t stream_page(uint16_t page, uint16_t dst_id, uint8_t flags, uint8_t frames) {
+    uint8_t *rx_buf = RX_BUF(flags);
+    uint32_t missing = ((uint32_t)2 << (frames - 1)) - 1;
+    uint8_t missing_frames = frames;
+    uint8_t window_remain = frames < BOOTLOADER_STREAM_WINDOW ? frames : BOOTLOADER_STREAM_WINDOW;
+    uint8_t nak_count = 0;
+    page = page * SPM_PAGESIZE;
 
-            boot_page_fill_safe(page + (SPM_PAGESIZE-bytes_remain), w);
-            bytes_remain -= 2;
+    if (!(flags & H9MSG_PAGE_START_FLAG_VERIFY))
+        schedule_erase(page);
 
-            if (bytes_remain == 0) {
-                cm_res.type = H9MSG_TYPE_PAGE_WRITED;
-                cm_res.dlc = 2;
-                cm_res.data[0] = (page >> 8) & 0xff;
-                cm_res.data[1] = (page) & 0xff;
+    send_stream_state(dst_id, missing, missing_frames);
+    while (1) {
+        h9msg_t cm;
+        if (!receive(&cm, STREAM_RX_TIMEOUT)) {
+            if (++nak_count > STREAM_MAX_NAK)
+                return 0;
+            window_remain = missing_frames < BOOTLOADER_STREAM_WINDOW ? missing_frames : BOOTLOADER_STREAM_WINDOW;
+            send_stream_state(dst_id, missing, missing_frames);
+            continue;
+        }
 
-                boot_page_write_safe(page);
-                boot_spm_busy_wait();
-                boot_rww_enable();
+        if (cm.source_id == dst_id && cm.type == H9MSG_TYPE_PAGE_FILL && cm.dlc == 8 && cm.seqnum < frames) {
+            uint32_t frame = (uint32_t)1 << cm.seqnum;
+            nak_count = 0;
+            if (missing & frame) {
+                uint8_t *dst = rx_buf + cm.seqnum * 8;
+                for (uint8_t i = 0; i < 8; ++i)
+                    dst[i] = cm.data[i];
+                missing &= ~frame;
+                --missing_frames;
+            }
 
-                CAN_put_msg_blocking(&cm_res);
-                break;
+            if (missing_frames == 0) {
+                finish_page(page, dst_id, seqnum++, flags, frames);
+                return 1;
             }
-            else {
-                cm_res.type = H9MSG_TYPE_PAGE_FILL_NEXT;
-                cm_res.dlc = 2;
-                cm_res.data[0] = (bytes_remain >> 8) & 0xff;
-                cm_res.data[1] = (bytes_remain) & 0xff;
-                CAN_put_msg_blocking(&cm_res);
+
+            if (--window_remain == 0) {
+                window_remain = missing_frames < BOOTLOADER_STREAM_WINDOW ? missing_frames : BOOTLOADER_STREAM_WINDOW;
+                send_stream_state(dst_id, missing, missing_frames);
             }
         }
         else if (cm.source_id == dst_id && (cm.type & H9MSG_BOOTLOADER_MSG_GROUP_MASK) == H9MSG_BOOTLOADER_MSG_GROUP) {
+            h9msg_t cm_res;
             cm_res.type = H9MSG_TYPE_PAGE_FILL_BREAK;
+            cm_res.priority = H9MSG_PRIORITY_HIGH;
+            cm_res.source_id = can_node_id;
+            cm_res.destination_id = dst_id;
+            cm_res.seqnum = cm.seqnum;
             cm_res.dlc = 0;
 
             CAN_put_msg_blocking(&cm_res);
+            return 1;
+        }
+    }
+}
+#endif //BOOTLOADER_STREAM
+
+#ifdef BOOTLOADER_MULTICAST
+/*
+ * Multicast session: MULTICAST_JOIN sent to H9MSG_BROADCAST_ID enrolls all nodes of the given MCU
+ * (and node type), then the host sends PAGE_START and PAGE_FILL frames (frame index in seqnum) to
+ * H9MSG_BROADCAST_ID. The nodes stay silent, a page is written as soon as all its frames are
+ * received. MULTICAST_END asks every node for the pages it has not received, the host sends
+ * them again.
+ * @retval 1 - the page is incomplete, cm holds a frame for the main loop
+ */
+static uint8_t multicast_page(h9msg_t *cm, uint8_t frames) {
+    uint16_t page = (cm->data[0] << 8 | cm->data[1]) * SPM_PAGESIZE;
+    uint8_t flags = cm->dlc >= 3 ? cm->data[2] : 0;
+    uint8_t *rx_buf = RX_BUF(flags);
+    uint32_t missing = ((uint32_t)2 << (frames - 1)) - 1;
+
+    if (!(flags & H9MSG_PAGE_START_FLAG_VERIFY))
+        schedule_erase(page);
+
+    while (receive(cm, CAN_RX_TIMEOUT)) {
+        if (cm->destination_id != H9MSG_BROADCAST_ID || cm->type != H9MSG_TYPE_PAGE_FILL || cm->dlc != 8 || cm->seqnum >= frames)
+            return 1;
+
+        uint8_t *dst = rx_buf + cm->seqnum * 8;
+        for (uint8_t i = 0; i < 8; ++i)
+            dst[i] = cm->data[i];
+        missing &= ~((uint32_t)1 << cm->seqnum);
+
+        if (!missing) {
+#ifdef BOOTLOADER_COMPRESS
+            if ((flags & H9MSG_PAGE_START_FLAG_COMPRESSED) && !unpack_page(frames))
+                break;
+#endif
+            commit_page(page, flags);
             break;
         }
     }
+    return 0;
+}
+
+
+static uint8_t multicast(h9msg_t *cm) {
+    if (cm->type == H9MSG_TYPE_NOP && cm->dlc == 5 && cm->data[0] == H9MSG_BOOTLOADER_CMD_MULTICAST_JOIN) {
+        uint16_t node_type = cm->data[3] << 8 | cm->data[4];
+        if (cm->data[1] != NODE_MCU || cm->data[2] != NODE_MCU_F)
+            return 0;
+        if (node_type && node_type != eeprom_read_word(H9BOOT_EE_NODE_TYPE))
+            return 0;
+
+        multicast_host = cm->source_id;
+        for (uint8_t i = 0; i < sizeof(page_received); ++i)
+            page_received[i] = 0;
+        CAN_set_multicast_host(multicast_host);
+        send_command_response(cm, 1);
+        return 0;
+    }
+
+    if (!multicast_host || cm->source_id != multicast_host)
+        return 0;
+
+    uint8_t frames = page_start_frames(cm, PAGE_FLAG_VERIFY | PAGE_FLAG_COMPRESSED);
+    if (frames) {
+        return multicast_page(cm, frames);
+    }
+    if (cm->type == H9MSG_TYPE_NOP && cm->dlc == 5 && cm->data[0] == H9MSG_BOOTLOADER_CMD_MULTICAST_END) {
+        uint16_t first = cm->data[1] << 8 | cm->data[2];
+        uint32_t end = (uint32_t)first + (cm->data[3] << 8 | cm->data[4]);
+        if (end > PAGE_COUNT)
+            end = PAGE_COUNT;
+
+        uint16_t not_received = 0;
+        uint16_t first_missing = 0;
+        uint16_t last_missing = 0;
+        for (uint16_t page = first; page < end; ++page) {
+            if (!(page_received[page >> 3] & (1 << (page & 0x07)))) {
+                if (!not_received)
+                    first_missing = page;
+                last_missing = page;
+                ++not_received;
+            }
+        }
+
+        cm->data[1] = (not_received >> 8) & 0xff;
+        cm->data[2] = (not_received) & 0xff;
+        cm->data[3] = (first_missing >> 8) & 0xff;
+        cm->data[4] = (first_missing) & 0xff;
+        cm->data[5] = (last_missing >> 8) & 0xff;
+        cm->data[6] = (last_missing) & 0xff;
+        send_command_response(cm, 7);
+    }
+    if (cm->type == H9MSG_TYPE_QUIT_BOOTLOADER && cm->dlc == 0) {
+        start_application();
+    }
+    return 0;
+}
+#endif //BOOTLOADER_MULTICAST
+
+#ifdef BOOTLOADER_BITRATE_SWITCH
+static void bitrate_command(h9msg_t *cm) {
+    uint16_t kbit = cm->data[1] << 8 | cm->data[2];
+    uint8_t fast = kbit == BOOTLOADER_FAST_BITRATE / 1000;
+    kbit = fast ? BOOTLOADER_FAST_BITRATE / 1000 : CAN_BITRATE / 1000;
+    cm->data[1] = (kbit >> 8) & 0xff;
+    cm->data[2] = (kbit) & 0xff;
+    send_command_response(cm, 3);
+    if (fast != fast_bitrate) {
+        CAN_set_fast_bitrate(fast);
+        fast_bitrate = fast;
+    }
+}
+#endif //BOOTLOADER_BITRATE_SWITCH
+
+// nothing received for the timeout, in the idle loop or in the middle of a page
+static void host_timeout(h9msg_t *turn_on_msg) {
+#ifdef BOOTLOADER_BITRATE_SWITCH
+    // the session host is gone, back to the bus everybody else uses
+    if (fast_bitrate) {
+        CAN_set_fast_bitrate(0);
+        fast_bitrate = 0;
+    }
+#endif
+    turn_on_msg->seqnum = seqnum++;
+    CAN_put_msg_blocking(turn_on_msg);
 }
 
 int main(void) {
+    /*
+     * Armed by the application before a jump or a reset. After a watchdog reset WDRF keeps WDE set until
+     * the application reads the reset reason from MCUSR, then the longest timeout, the waits below reset it.
+     */
+    wdt_reset();
+    if (MCUSR & (1 << WDRF))
+        wdt_enable(WDTO_2S);
+    else
+        wdt_disable();
+
+#ifdef BOOTLOADER_FASTBOOT
+    if (!upgrade_request && app_valid())
+        start_application();
+    app_pages = read_app_pages();
+#endif
+
     DDRB = 0xff;
     DDRC = 0xff;
     DDRD = 0xff;
@@ -115,38 +674,34 @@ int main(void) {
     turn_on_msg.dlc = 4;
     turn_on_msg.data[0] = BOOTLOADER_VERSION_MAJOR;
     turn_on_msg.data[1] = BOOTLOADER_VERSION_MINOR;
-#if defined (__AVR_ATmega16M1__)
-    turn_on_msg.data[2] = NODE_MCU_ATMEGA16M1;
-#elif defined (__AVR_ATmega32M1__)
-    turn_on_msg.data[2] = NODE_MCU_ATMEGA32M1;
-#elif defined (__AVR_ATmega64M1__)
-    turn_on_msg.data[2] = NODE_MCU_ATMEGA64M1;
-#elif defined (__AVR_AT90CAN128__)
-    turn_on_msg.data[2] = NODE_MCU_AT90CAN128;
-#elif defined (__AVR_ATmega32C1__)
-    turn_on_msg.data[2] = NODE_MCU_ATMEGA32C1;
-#else
-#error "Unsupported MCU"
-#endif
-
-#if F_CPU == 4000000UL
-    turn_on_msg.data[3] = NODE_MCU_F_4MHz;
-#elif F_CPU == 12000000UL
-    turn_on_msg.data[3] = NODE_MCU_F_12MHz;
-#elif F_CPU == 16000000UL
-    turn_on_msg.data[3] = NODE_MCU_F_16MHz;
-#else
-#error "Please specify F_CPU"
-#endif
+    turn_on_msg.data[2] = NODE_MCU;
+    turn_on_msg.data[3] = NODE_MCU_F;
 //    turn_on_msg.data[3] = (NODE_TYPE >> 8) & 0xff;
 //    turn_on_msg.data[4] = (NODE_TYPE) & 0xff;
     CAN_put_msg_blocking(&turn_on_msg);
     
+    h9msg_t cm;
+    uint8_t msg_pending = 0;
     while (1) {
-        h9msg_t cm;
-        if (CAN_get_msg_blocking(&cm)) {
-            if (cm.type == H9MSG_TYPE_PAGE_START && cm.dlc == 2) {
+        if (msg_pending || CAN_get_msg_blocking(&cm, CAN_RX_TIMEOUT)) {
+            msg_pending = 0;
+#ifdef BOOTLOADER_MULTICAST
+            if (cm.destination_id == H9MSG_BROADCAST_ID) {
+                msg_pending = multicast(&cm);
+                continue;
+            }
+#endif
+            uint8_t frames = page_start_frames(&cm, PAGE_FLAGS_SUPPORTED);
+            if (frames) {
                 uint16_t page = cm.data[0] << 8 | cm.data[1];
+                uint8_t flags = cm.dlc >= 3 ? cm.data[2] : 0;
+#ifdef BOOTLOADER_STREAM
+                if (flags & H9MSG_PAGE_START_FLAG_STREAM) {
+                    if (!stream_page(page, cm.source_id, flags, frames))
+                        host_timeout(&turn_on_msg);
+                    continue;
+                }
+#endif
 
                 h9msg_t cm_res;
                 cm_res.type = H9MSG_TYPE_PAGE_FILL_NEXT;
@@ -155,21 +710,33 @@ int main(void) {
                 cm_res.destination_id = cm.source_id;
                 cm_res.seqnum = seqnum++;
                 cm_res.dlc = 2;
-                cm_res.data[0] = (SPM_PAGESIZE >> 8) & 0xff;
-                cm_res.data[1] = (SPM_PAGESIZE) & 0xff;
+                cm_res.data[0] = ((frames * 8) >> 8) & 0xff;
+                cm_res.data[1] = (frames * 8) & 0xff;
 
                 CAN_put_msg_blocking(&cm_res);
 
-                write_page(page, cm.source_id);
+                if (!write_page(page, cm.source_id, flags, frames))
+                    host_timeout(&turn_on_msg);
+            }
+#ifdef BOOTLOADER_VERIFY
+            if (cm.type == H9MSG_TYPE_NOP && cm.dlc == 5 && cm.data[0] == H9MSG_BOOTLOADER_CMD_PAGE_CRC) {
+                uint16_t crc = flash_crc(cm.data[1] << 8 | cm.data[2], cm.data[3] << 8 | cm.data[4]);
+                cm.data[5] = (crc >> 8) & 0xff;
+                cm.data[6] = (crc) & 0xff;
+                send_command_response(&cm, 7);
             }
+#endif
+#ifdef BOOTLOADER_BITRATE_SWITCH
+            if (cm.type == H9MSG_TYPE_NOP && cm.dlc == 3 && cm.data[0] == H9MSG_BOOTLOADER_CMD_BITRATE) {
+                bitrate_command(&cm);
+            }
+#endif
             if (cm.type == H9MSG_TYPE_QUIT_BOOTLOADER && cm.dlc == 0) {
-                MCUCR &= ~(1 << IVSEL);
-                asm volatile ("jmp  0x0000");
+                start_application();
             }
         }
         else {
-            turn_on_msg.seqnum = seqnum++;
-            CAN_put_msg_blocking(&turn_on_msg);
+            host_timeout(&turn_on_msg);
         }
     }
 }
@@ -6,8 +6,16 @@
  *
  */
 
+#include "config.h"
+
+#include <avr/wdt.h>
+
 #include "can.h"
 
+// MOb0 transmits, all the others form the receive FIFO
+#define RX_MOB_FIRST 1
+#define RX_MOB_LAST 5
+
 
 volatile uint16_t can_node_id;
 uint16_t ee_node_id EEMEM = 0;
@@ -15,6 +23,7 @@ uint16_t ee_node_id EEMEM = 0;
 static void read_node_id(void);
 static void set_CAN_id(uint8_t priority, uint8_t type, uint8_t seqnum, uint16_t destination_id, uint16_t source_id);
 static void set_CAN_id_mask(uint8_t priority, uint8_t type, uint8_t seqnum, uint16_t destination_id, uint16_t source_id);
+static void set_rx_mob(uint8_t mob, uint16_t destination_id, uint16_t source_id, uint16_t source_id_mask);
 
 
 void CAN_init(void) {
@@ -23,21 +32,10 @@ void CAN_init(void) {
     CANGCON = ( 1 << SWRES );   // Software reset
     CANTCON = 0x00;             // CAN timing prescaler set to 0;
 
-    #if F_CPU == 4000000UL
-        CANBT1 = 0x06;
-        CANBT2 = 0x04;
-        CANBT3 = 0x13;
-    #elif F_CPU == 12000000UL
-        CANBT1 = 0x16;
-        CANBT2 = 0x04;
-        CANBT3 = 0x13;
-    #elif F_CPU == 16000000UL
-        CANBT1 = 0x1e;
-        CANBT2 = 0x04;
-        CANBT3 = 0x13;
-    #else
-        #error "Please specify F_CPU"
-    #endif
+    // CAN_BITRATE and CAN_SAMPLE_POINT from config.h
+    CANBT1 = CAN_BT1_VALUE;
+    CANBT2 = CAN_BT2_VALUE;
+    CANBT3 = CAN_BT3_VALUE;
 
     for ( int8_t mob=0; mob<6; mob++ ) {
         CANPAGE = ( mob << MOBNB0 ); // Selects Message Object 0-5
@@ -45,12 +43,14 @@ void CAN_init(void) {
         CANSTMOB = 0x00;             // Clear mob status register;
     }
 
-    // 1st msg filter
-    CANPAGE = 0x01 << MOBNB0;
-    set_CAN_id(0, H9MSG_BOOTLOADER_MSG_GROUP, 0, can_node_id, 0);
-    set_CAN_id_mask(0, H9MSG_BOOTLOADER_MSG_GROUP_MASK, 0, (1<<H9MSG_ID_BIT_LENGTH)-1, 0);
-    CANIDM4 |= 1 << IDEMSK;
-    CANCDMOB = (1<<CONMOB1) | (1<<IDE); //rx mob, 29-bit only
+    // 1st msg filter, the same on every rx mob
+    for (uint8_t mob = RX_MOB_FIRST; mob <= RX_MOB_LAST; ++mob) {
+        set_rx_mob(mob, can_node_id, 0, 0);
+    }
+#ifdef BOOTLOADER_MULTICAST
+    // the last one waits for the multicast session join
+    set_rx_mob(RX_MOB_LAST, H9MSG_BROADCAST_ID, 0, 0);
+#endif
 
     CANGCON = 1<<ENASTB;
 }
@@ -71,35 +71,92 @@ void CAN_put_msg_blocking(h9msg_t *cm) {
 }
 
 
-uint8_t CAN_get_msg_blocking(h9msg_t *cm) {
-    uint32_t timeout_counter = 0x1fffff;
+#ifdef BOOTLOADER_MULTICAST
+void CAN_set_multicast_host(uint16_t host_id) {
+    // the first rx mob stays for unicast, all the others take the session stream
+    for (uint8_t mob = RX_MOB_FIRST + 1; mob <= RX_MOB_LAST; ++mob) {
+        set_rx_mob(mob, H9MSG_BROADCAST_ID, host_id, (1<<H9MSG_ID_BIT_LENGTH)-1);
+    }
+}
+#endif
+
+
+#ifdef BOOTLOADER_BITRATE_SWITCH
+#if !CAN_BT_VALID_(BOOTLOADER_FAST_BITRATE)
+#error "BOOTLOADER_FAST_BITRATE is not reachable from this F_CPU"
+#endif
+
+void CAN_set_fast_bitrate(uint8_t fast) {
+    while (CANEN2 & (1 << ENMOB0)); // the answer goes at the old rate
+    CANGCON = 0;                    // standby, the MObs keep their settings
+    while (CANGSTA & (1 << ENFG));
+    if (fast) {
+        CANBT1 = CAN_BT1_(BOOTLOADER_FAST_BITRATE);
+        CANBT2 = CAN_BT2_(BOOTLOADER_FAST_BITRATE);
+        CANBT3 = CAN_BT3_(BOOTLOADER_FAST_BITRATE);
+    }
+    else {
+        CANBT1 = CAN_BT1_VALUE;
+        CANBT2 = CAN_BT2_VALUE;
+        CANBT3 = CAN_BT3_VALUE;
+    }
+    CANGCON = 1<<ENASTB;
+}
+#endif
 
-    while (timeout_counter) {
-        CANPAGE = 0x01 << MOBNB0;
+
+uint8_t CAN_get_msg(h9msg_t *cm) {
+    // a burst spreads over the rx mobs in any order, the oldest time stamp goes first
+    uint8_t rx_mob = 0;
+    uint16_t oldest = 0;
+    for (uint8_t mob = RX_MOB_FIRST; mob <= RX_MOB_LAST; ++mob) {
+        CANPAGE = mob << MOBNB0;
         if (CANSTMOB & (1 << RXOK)) {
+            uint16_t stamp = CANSTML;
+            stamp |= CANSTMH << 8;
+            if (!rx_mob || (int16_t)(stamp - oldest) < 0) {
+                rx_mob = mob;
+                oldest = stamp;
+            }
+        }
+    }
 
-            uint8_t canidt1 = CANIDT1;
-            uint8_t canidt2 = CANIDT2;
-            uint8_t canidt3 = CANIDT3;
-            uint8_t canidt4 = CANIDT4;
-            uint8_t cancdmob = CANCDMOB & 0x1f;
+    if (rx_mob) {
+        CANPAGE = rx_mob << MOBNB0;
 
-            for (uint8_t i = 0; i < 8; ++i) {
-                cm->data[i] = CANMSG;
-            }
+        uint8_t canidt1 = CANIDT1;
+        uint8_t canidt2 = CANIDT2;
+        uint8_t canidt3 = CANIDT3;
+        uint8_t canidt4 = CANIDT4;
+        uint8_t cancdmob = CANCDMOB & 0x1f;
+
+        for (uint8_t i = 0; i < 8; ++i) {
+            cm->data[i] = CANMSG;
+        }
+
+        cm->priority = (canidt1 >> 7) & 0x01;
+        cm->type = (canidt1 >> 2) & 0x1f;
+        cm->seqnum = ((canidt1 << 3) & 0x18) | ((canidt2 >> 5) & 0x07);
+        cm->destination_id = ((canidt2 << 4) & 0x1f0) | ((canidt3 >> 4) & 0x0f);
+        cm->source_id = ((canidt3 << 5) & 0x1e0) | ((canidt4 >> 3) & 0x1f);
 
-            cm->priority = (canidt1 >> 7) & 0x01;
-            cm->type = (canidt1 >> 2) & 0x1f;
-            cm->seqnum = ((canidt1 << 3) & 0x18) | ((canidt2 >> 5) & 0x07);
-            cm->destination_id = ((canidt2 << 4) & 0x1f0) | ((canidt3 >> 4) & 0x0f);
-            cm->source_id = ((canidt3 << 5) & 0x1e0) | ((canidt4 >> 3) & 0x1f);
+        cm->dlc = cancdmob & 0x0f;
+
+        CANCDMOB = (1 << CONMOB1) | (1 << IDE); //rx mob
+        CANSTMOB = 0x00;
+        return 1;
+    }
+    return 0;
+}
 
-            cm->dlc = cancdmob & 0x0f;
 
-            CANCDMOB = (1 << CONMOB1) | (1 << IDE); //rx mob
-            CANSTMOB = 0x00;
+uint8_t CAN_get_msg_blocking(h9msg_t *cm, uint32_t timeout) {
+    uint32_t timeout_counter = timeout;
+
+    while (timeout_counter) {
+        wdt_reset(); // on after a watchdog reset, see main()
+        if (CAN_get_msg(cm))
             return 1;
-        }
         --timeout_counter;
     }
     return 0;
@@ -131,3 +188,14 @@ void set_CAN_id_mask(uint8_t priority, uint8_t type, uint8_t seqnum, uint16_t de
     CANIDM3 = ((destination_id << 4) & 0xf0) | ((source_id >> 5) & 0x0f);
     CANIDM4 = ((source_id << 3) & 0xf8);
 }
+
+
+void set_rx_mob(uint8_t mob, uint16_t destination_id, uint16_t source_id, uint16_t source_id_mask) {
+    CANPAGE = mob << MOBNB0;
+    CANCDMOB = 0x00;
+    CANSTMOB = 0x00;
+    set_CAN_id(0, H9MSG_BOOTLOADER_MSG_GROUP, 0, destination_id, source_id);
+    set_CAN_id_mask(0, H9MSG_BOOTLOADER_MSG_GROUP_MASK, 0, (1<<H9MSG_ID_BIT_LENGTH)-1, source_id_mask);
+    CANIDM4 |= 1 << IDEMSK;
+    CANCDMOB = (1<<CONMOB1) | (1<<IDE); //rx mob, 29-bit only
+}
@@ -13,6 +13,9 @@
 #include <avr/eeprom.h>
 
 #include "../include/h9msg.h"
+#include "../include/avr/can_bittiming.h"
+
+#define CAN_RX_TIMEOUT 0x1fffff
 
 extern uint16_t ee_node_id EEMEM;
 extern volatile uint16_t can_node_id;
@@ -20,6 +23,21 @@ extern volatile uint16_t can_node_id;
 void CAN_init(void);
 
 void CAN_put_msg_blocking(h9msg_t *cm);
-uint8_t CAN_get_msg_blocking(h9msg_t *cm);
+uint8_t CAN_get_msg(h9msg_t *cm);
+uint8_t CAN_get_msg_blocking(h9msg_t *cm, uint32_t timeout);
+
+#ifdef BOOTLOADER_MULTICAST
+/**
+ * Switches all rx MObs but the first one to frames sent by host_id to H9MSG_BROADCAST_ID.
+ */
+void CAN_set_multicast_host(uint16_t host_id);
+#endif
+
+#ifdef BOOTLOADER_BITRATE_SWITCH
+/**
+ * Waits for MOb0 to finish and restarts the controller at BOOTLOADER_FAST_BITRATE or at CAN_BITRATE.
+ */
+void CAN_set_fast_bitrate(uint8_t fast);
+#endif
 
 #endif //_CAN_H_
@@ -9,9 +9,51 @@ set(bootstart_atmega64m1 0xf800)
 set(bootstart_atmega64c1 0xf800)
 set(bootstart_at90can128 0x1F800)
 
+#
+# ${flash_size_${mmcu}}
+# the boot section runs from bootstart to the end of the flash
+#
+set(flash_size_atmega16m1 0x4000)
+set(flash_size_atmega16c1 0x4000)
+set(flash_size_atmega32m1 0x8000)
+set(flash_size_atmega32c1 0x8000)
+set(flash_size_atmega64m1 0x10000)
+set(flash_size_atmega64c1 0x10000)
+set(flash_size_at90can128 0x20000)
+
+#
+# ${can_rx_buf_size_${mmcu}} ${can_tx_buf_size_${mmcu}}
+# bytes of the packed rx ring and of each tx ring (one per priority), a power of two from 16 to 256
+#
+set(can_rx_buf_size_atmega16m1 256)
+set(can_tx_buf_size_atmega16m1 64)
+set(can_rx_buf_size_atmega16c1 256)
+set(can_tx_buf_size_atmega16c1 64)
+set(can_rx_buf_size_atmega32m1 256)
+set(can_tx_buf_size_atmega32m1 128)
+set(can_rx_buf_size_atmega32c1 256)
+set(can_tx_buf_size_atmega32c1 128)
+set(can_rx_buf_size_atmega64m1 256)
+set(can_tx_buf_size_atmega64m1 256)
+set(can_rx_buf_size_atmega64c1 256)
+set(can_tx_buf_size_atmega64c1 256)
+set(can_rx_buf_size_at90can128 256)
+set(can_tx_buf_size_at90can128 256)
+
+set(fcpu_2M 2000000UL)
 set(fcpu_4M 4000000UL)
+set(fcpu_6M 6000000UL)
+set(fcpu_8M 8000000UL)
 set(fcpu_12M 12000000UL)
 set(fcpu_16M 16000000UL)
 
+#
+# CAN bit timing of every library and bootloader target, computed by include/avr/can_bittiming.h;
+# a bit rate the F_CPU of a target cannot reach stops the build, leave that frequency out of AVR_FREQS
+#
+set(CAN_BITRATE 125000 CACHE STRING "CAN bit rate in bit/s")
+set(CAN_SAMPLE_POINT 75 CACHE STRING "CAN sample point in percent of the bit")
+set(AVR_FREQS "4M;12M;16M" CACHE STRING "Library and bootloader target frequencies, from 2M 4M 6M 8M 12M 16M")
+
 set(avr_mmcus atmega16m1 atmega32m1 atmega64m1 atmega32c1 at90can128)
-set(avr_freqs 4M 12M 16M)
+set(avr_freqs ${AVR_FREQS})
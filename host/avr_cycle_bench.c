@@ -0,0 +1,329 @@
+// SPDX-License-Identifier: MIT
+/*
+ * H9 CAN cycle benchmark - runs the benchmark firmware under simavr with a stubbed CAN controller
+ *
+ * Copyright (C) 2024 Kamil Pałkowski
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_io.h"
+#include "sim_interrupts.h"
+
+#include "can_emu.h"
+#include "../avr_bench/bench.h"
+
+#define MAX_CYCLES 500000000ULL
+
+// CAN register block, identical on the ATmegaxxM1/C1 and AT90CAN128
+enum {
+    REG_CANGCON = 0xd8,
+    REG_CANGSTA,
+    REG_CANGIT,
+    REG_CANGIE,
+    REG_CANEN2,
+    REG_CANEN1,
+    REG_CANIE2,
+    REG_CANIE1,
+    REG_CANSIT2,
+    REG_CANSIT1,
+    REG_CANBT1,
+    REG_CANBT2,
+    REG_CANBT3,
+    REG_CANTCON,
+    REG_CANTIML,
+    REG_CANTIMH,
+    REG_CANTTCL,
+    REG_CANTTCH,
+    REG_CANTEC,
+    REG_CANREC,
+    REG_CANHPMOB,
+    REG_CANPAGE,
+    REG_CANSTMOB,
+    REG_CANCDMOB,
+    REG_CANIDT4,
+    REG_CANIDT3,
+    REG_CANIDT2,
+    REG_CANIDT1,
+    REG_CANIDM4,
+    REG_CANIDM3,
+    REG_CANIDM2,
+    REG_CANIDM1,
+    REG_CANSTML,
+    REG_CANSTMH,
+    REG_CANMSG,
+};
+
+#define CANGCON_SWRES 0
+#define CANGIE_ENIT 7
+#define CANCDMOB_CONMOB_MASK 0xc0
+#define CANCDMOB_CONMOB_TX 0x40
+
+#define H9MSG_TYPE_PAGE_FILL 3
+#define H9MSG_TYPE_PAGE_FILL_NEXT 5
+
+struct result {
+    uint32_t samples;
+    avr_cycle_count_t min;
+    avr_cycle_count_t max;
+};
+
+static avr_int_vector_t can_vector;
+static uint8_t flash_host;
+static uint8_t done;
+static uint8_t current_bench;
+static avr_cycle_count_t bench_start;
+static struct result results[256];
+
+
+/* the emulated controller is driven by simavr, CAN_INT_vect runs on the simulated core */
+void can_emu_can_int_vect(void) {
+}
+
+
+static void update_irq(avr_t *avr) {
+    if (can_vector.vector && can_emu_irq_pending())
+        avr_raise_interrupt(avr, &can_vector);
+}
+
+
+static void flash_host_transmit(void) {
+    struct can_emu_frame frame;
+    while (can_emu_transmit(&frame)) {
+        uint8_t type = (frame.canidt1 >> 2) & 0x1f;
+        if (type != H9MSG_TYPE_PAGE_FILL_NEXT)
+            continue;
+
+        uint8_t seqnum = ((frame.canidt1 << 3) & 0x18) | ((frame.canidt2 >> 5) & 0x07);
+        uint16_t node_id = ((frame.canidt3 << 5) & 0x1e0) | ((frame.canidt4 >> 3) & 0x1f);
+        uint16_t host_id = ((frame.canidt2 << 4) & 0x1f0) | ((frame.canidt3 >> 4) & 0x0f);
+
+        struct can_emu_frame fill;
+        can_emu_frame_set_id(&fill, 0, H9MSG_TYPE_PAGE_FILL, seqnum, node_id, host_id);
+        fill.dlc = 8;
+        for (uint8_t i = 0; i < 8; ++i)
+            fill.data[i] = (uint8_t)(seqnum + i);
+        can_emu_receive(&fill);
+    }
+}
+
+
+static void command(avr_t *avr, uint8_t cmd) {
+    if ((cmd & 0xf0) == BENCH_CMD_INJECT) {
+        struct can_emu_mob *mob = &can_emu.mob[(cmd & 0x0f) % CAN_EMU_MOB_COUNT];
+        struct can_emu_frame frame = {
+            .canidt1 = mob->canidt1,
+            .canidt2 = mob->canidt2,
+            .canidt3 = mob->canidt3,
+            .canidt4 = mob->canidt4,
+            .dlc = mob->cancdmob & 0x0f,
+        };
+        memcpy(frame.data, mob->msg, sizeof(frame.data));
+        can_emu_receive(&frame);
+    }
+    else if (cmd == BENCH_CMD_TX_DONE) {
+        struct can_emu_frame frame;
+        while (can_emu_transmit(&frame));
+    }
+    else if (cmd == BENCH_CMD_FLASH_HOST) {
+        flash_host = 1;
+    }
+    else if (cmd == BENCH_CMD_EXIT) {
+        done = 1;
+    }
+}
+
+
+static void mark(avr_t *avr, uint8_t id) {
+    if (id) {
+        current_bench = id;
+        bench_start = avr->cycle;
+    }
+    else if (current_bench) {
+        avr_cycle_count_t cycles = avr->cycle - bench_start;
+        struct result *r = &results[current_bench];
+        if (!r->samples || cycles < r->min)
+            r->min = cycles;
+        if (cycles > r->max)
+            r->max = cycles;
+        ++r->samples;
+        current_bench = 0;
+    }
+}
+
+
+static uint8_t can_reg_read(avr_t *avr, avr_io_addr_t addr, void *param) {
+    switch (addr) {
+        case REG_CANGCON: return can_emu.cangcon;
+        case REG_CANGSTA: return can_emu.cangsta;
+        case REG_CANGIT: return can_emu.cangit;
+        case REG_CANGIE: return can_emu.cangie;
+        case REG_CANEN2: return can_emu_en2();
+        case REG_CANIE2: return can_emu.canie2;
+        case REG_CANSIT2: return can_emu.cansit2;
+        case REG_CANBT1: return can_emu.canbt1;
+        case REG_CANBT2: return can_emu.canbt2;
+        case REG_CANBT3: return can_emu.canbt3;
+        case REG_CANTCON: return can_emu.cantcon;
+        case REG_CANTIML: return can_emu.cantim & 0xff;
+        case REG_CANTIMH: return can_emu.cantim >> 8;
+        case REG_CANTEC: return can_emu.cantec;
+        case REG_CANREC: return can_emu.canrec;
+        case REG_CANHPMOB: return can_emu_hpmob();
+        case REG_CANPAGE: return can_emu.canpage;
+        case REG_CANSTMOB: return can_emu_page_mob()->canstmob;
+        case REG_CANCDMOB: return can_emu_page_mob()->cancdmob;
+        case REG_CANIDT4: return can_emu_page_mob()->canidt4;
+        case REG_CANIDT3: return can_emu_page_mob()->canidt3;
+        case REG_CANIDT2: return can_emu_page_mob()->canidt2;
+        case REG_CANIDT1: return can_emu_page_mob()->canidt1;
+        case REG_CANIDM4: return can_emu_page_mob()->canidm4;
+        case REG_CANIDM3: return can_emu_page_mob()->canidm3;
+        case REG_CANIDM2: return can_emu_page_mob()->canidm2;
+        case REG_CANIDM1: return can_emu_page_mob()->canidm1;
+        case REG_CANSTML: return can_emu_page_mob()->canstm & 0xff;
+        case REG_CANSTMH: return can_emu_page_mob()->canstm >> 8;
+        case REG_CANMSG: return *can_emu_msg();
+        default: return avr->data[addr];
+    }
+}
+
+
+static void can_reg_write(avr_t *avr, avr_io_addr_t addr, uint8_t v, void *param) {
+    avr->data[addr] = v;
+    switch (addr) {
+        case REG_CANGCON:
+            if (v & (1 << CANGCON_SWRES)) {
+                uint8_t mcusr = can_emu.mcusr;
+                can_emu_reset();
+                can_emu.mcusr = mcusr;
+                can_emu.sreg = 0;   // interrupts are delivered by simavr
+            }
+            else {
+                can_emu.cangcon = v;
+            }
+            break;
+        case REG_CANGIT: can_emu.cangit &= ~(v & 0x7f); break;
+        case REG_CANGIE: can_emu.cangie = v; break;
+        case REG_CANIE2: can_emu.canie2 = v; break;
+        case REG_CANSIT2: can_emu.cansit2 = v; break;
+        case REG_CANBT1: can_emu.canbt1 = v; break;
+        case REG_CANBT2: can_emu.canbt2 = v; break;
+        case REG_CANBT3: can_emu.canbt3 = v; break;
+        case REG_CANTCON: can_emu.cantcon = v; break;
+        case REG_CANTEC: can_emu.cantec = v; break;
+        case REG_CANREC: can_emu.canrec = v; break;
+        case REG_CANPAGE: can_emu.canpage = v; break;
+        case REG_CANSTMOB: can_emu_page_mob()->canstmob = v; break;
+        case REG_CANCDMOB:
+            can_emu_page_mob()->cancdmob = v;
+            if (flash_host && (v & CANCDMOB_CONMOB_MASK) == CANCDMOB_CONMOB_TX)
+                flash_host_transmit();
+            break;
+        case REG_CANIDT4: can_emu_page_mob()->canidt4 = v; break;
+        case REG_CANIDT3: can_emu_page_mob()->canidt3 = v; break;
+        case REG_CANIDT2: can_emu_page_mob()->canidt2 = v; break;
+        case REG_CANIDT1: can_emu_page_mob()->canidt1 = v; break;
+        case REG_CANIDM4: can_emu_page_mob()->canidm4 = v; break;
+        case REG_CANIDM3: can_emu_page_mob()->canidm3 = v; break;
+        case REG_CANIDM2: can_emu_page_mob()->canidm2 = v; break;
+        case REG_CANIDM1: can_emu_page_mob()->canidm1 = v; break;
+        case REG_CANMSG: *can_emu_msg() = v; break;
+        case BENCH_MARK_ADDR: mark(avr, v); break;
+        case BENCH_CMD_ADDR: command(avr, v); break;
+        case BENCH_VECTOR_ADDR:
+            if (v && !can_vector.vector) {
+                can_vector.vector = v;
+                can_vector.enable = (avr_regbit_t)AVR_IO_REGBIT(REG_CANGIE, CANGIE_ENIT);
+                avr_register_vector(avr, &can_vector);
+            }
+            break;
+        default:
+            break;
+    }
+    update_irq(avr);
+}
+
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-H] -m mmcu -f frequency firmware.elf\n", name);
+    fprintf(stderr, "  -H  print the table header\n");
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char **argv) {
+    const char *mmcu = NULL;
+    uint32_t frequency = 0;
+    int header = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "Hm:f:")) != -1) {
+        switch (opt) {
+            case 'H': header = 1; break;
+            case 'm': mmcu = optarg; break;
+            case 'f': frequency = (uint32_t)strtoul(optarg, NULL, 0); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (header)
+        printf("mmcu\tfreq\tbenchmark\tsamples\tcycles_min\tcycles_max\tus_max\n");
+    if (optind == argc && header)
+        return EXIT_SUCCESS;
+    if (optind != argc - 1 || !mmcu || !frequency)
+        usage(argv[0]);
+
+    elf_firmware_t firmware;
+    memset(&firmware, 0, sizeof(firmware));
+    if (elf_read_firmware(argv[optind], &firmware)) {
+        fprintf(stderr, "%s: unable to load %s\n", argv[0], argv[optind]);
+        return EXIT_FAILURE;
+    }
+    snprintf(firmware.mmcu, sizeof(firmware.mmcu), "%s", mmcu);
+    firmware.frequency = frequency;
+
+    avr_t *avr = avr_make_mcu_by_name(firmware.mmcu);
+    if (!avr) {
+        fprintf(stderr, "%s: simavr has no core for %s\n", argv[0], mmcu);
+        return 2;
+    }
+    avr_init(avr);
+    avr_load_firmware(avr, &firmware);
+    avr->frequency = frequency;
+
+    can_emu_reset();
+    can_emu.sreg = 0;   // interrupts are delivered by simavr
+    for (avr_io_addr_t addr = REG_CANGCON; addr <= REG_CANMSG; ++addr) {
+        avr_register_io_read(avr, addr, can_reg_read, NULL);
+        avr_register_io_write(avr, addr, can_reg_write, NULL);
+    }
+
+    int state = cpu_Running;
+    while (!done && state != cpu_Done && state != cpu_Crashed && avr->cycle < MAX_CYCLES)
+        state = avr_run(avr);
+
+    if (!done) {
+        fprintf(stderr, "%s: %s did not finish (state %d, %llu cycles)\n", argv[0], argv[optind], state,
+                (unsigned long long)avr->cycle);
+        return EXIT_FAILURE;
+    }
+
+    avr_cycle_count_t overhead = results[BENCH_EMPTY].samples ? results[BENCH_EMPTY].min : 0;
+#define BENCH_ROW(name, id, text) \
+    if (id != BENCH_EMPTY && results[id].samples) { \
+        avr_cycle_count_t min = results[id].min - overhead; \
+        avr_cycle_count_t max = results[id].max - overhead; \
+        printf("%s\t%u\t%s\t%u\t%llu\t%llu\t%.2f\n", mmcu, frequency, text, results[id].samples, \
+               (unsigned long long)min, (unsigned long long)max, max * 1e6 / frequency); \
+    }
+    BENCH_LIST(BENCH_ROW)
+#undef BENCH_ROW
+
+    return EXIT_SUCCESS;
+}
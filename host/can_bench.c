@@ -0,0 +1,1053 @@
+// SPDX-License-Identifier: MIT
+/*
+ * H9 CAN host build - frame path benchmark
+ *
+ * Copyright (C) 2024 Kamil Pałkowski
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "can_emu.h"
+
+/* the CANGIT flags raised at the next ring index update, the interrupt comes in the middle of the driver call */
+static uint8_t barrier_cangit;
+static void barrier_irq(void);
+#define CAN_BARRIER() barrier_irq()
+
+/* white-box build: the benchmark needs the static helpers of the driver */
+#include "../avr/can.c"
+
+#define BENCH_NODE_ID 0x020
+#define BENCH_REMOTE_ID 0x031
+
+static volatile uint32_t sink;
+
+// the benchmarks check what they measured, a wrong answer stops the run
+#define BENCH_CHECK(cond) do { if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); exit(EXIT_FAILURE); } } while (0)
+
+typedef void (*bench_fn_t)(uint32_t iterations);
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+
+static void barrier_irq(void) {
+    __asm__ __volatile__ ("" ::: "memory");
+    if (barrier_cangit) {
+        uint8_t cangit = barrier_cangit;
+        barrier_cangit = 0;
+        can_emu_general_irq(cangit);
+    }
+}
+
+
+static void setup(void) {
+    can_emu_reset();
+    ee_node_id = BENCH_NODE_ID;
+    CAN_init(0x0101, 'a', 1, 0, "bench");
+    can_rx_buf_top = can_rx_buf_bottom = 0;
+    memset((void *)can_tx_buf_top, 0, sizeof(can_tx_buf_top));
+    memset((void *)can_tx_buf_bottom, 0, sizeof(can_tx_buf_bottom));
+}
+
+
+static void release_tx_mobs(void) {
+    for (uint8_t mob = 0; mob < CAN_EMU_MOB_COUNT; ++mob) {
+        if (can_tx_mobs & (1 << mob)) {
+            can_emu.mob[mob].cancdmob = 0;
+            can_emu.mob[mob].canstmob = 0;
+        }
+    }
+}
+
+
+static void check_frame(const struct can_emu_frame *frame, uint8_t type, uint16_t destination_id, uint8_t dlc) {
+    BENCH_CHECK(((frame->canidt1 >> 2) & 0x1f) == type);
+    BENCH_CHECK((((frame->canidt2 << 4) & 0x1f0) | ((frame->canidt3 >> 4) & 0x0f)) == destination_id);
+    BENCH_CHECK((((frame->canidt3 << 5) & 0x1e0) | ((frame->canidt4 >> 3) & 0x1f)) == BENCH_NODE_ID);
+    BENCH_CHECK(frame->dlc == dlc);
+}
+
+
+// the one frame the node sends next
+static void check_sent(uint8_t type, uint16_t destination_id, uint8_t dlc, uint8_t data0) {
+    struct can_emu_frame frame;
+    BENCH_CHECK(can_emu_transmit(&frame));
+    check_frame(&frame, type, destination_id, dlc);
+    BENCH_CHECK(frame.data[0] == data0);
+}
+
+
+// the received frames through CAN_get_msg, the driver's own ones return 0
+static void drain_rx(void) {
+    h9msg_t cm;
+    do {
+        CAN_get_msg(&cm);
+    } while (can_rx_buf_top != can_rx_buf_bottom);
+}
+
+
+// loads every tx MOb, the last frame stays in can_tx_buf
+static void occupy_tx_mobs(h9msg_t *cm) {
+    while (CAN_put_msg(cm) == 1);
+}
+
+
+static void bench_calc_can_id(uint32_t iterations) {
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < iterations; ++i) {
+        uint8_t type = i & 0x1f;
+        uint16_t dst = (i >> 5) & 0x1ff;
+        acc += calc_can_id1(i & 1, type, i & 0x1f, dst, BENCH_NODE_ID);
+        acc += calc_can_id2(i & 1, type, i & 0x1f, dst, BENCH_NODE_ID);
+        acc += calc_can_id3(i & 1, type, i & 0x1f, dst, BENCH_NODE_ID);
+        acc += calc_can_id4(i & 1, type, i & 0x1f, dst, BENCH_NODE_ID);
+    }
+    sink = acc;
+}
+
+
+static void bench_decode(uint32_t iterations) {
+    struct can_emu_frame frame;
+    can_emu_frame_set_id(&frame, H9MSG_PRIORITY_LOW, H9MSG_TYPE_REG_VALUE, 0, BENCH_NODE_ID, BENCH_REMOTE_ID);
+    const uint8_t record[CAN_BUF_HEADER_SIZE + 3] = {
+            3, frame.canidt1, frame.canidt2, frame.canidt3, frame.canidt4, 0x5a, 0x5a, 0x5a
+    };
+
+    uint32_t acc = 0;
+    h9msg_t cm;
+    for (uint32_t i = 0; i < iterations; ++i) {
+        for (uint8_t idx = 0; idx < sizeof(record); ++idx) {
+            can_rx_buf[can_rx_buf_top] = record[idx];
+            can_rx_buf_top = (uint8_t)((can_rx_buf_top + 1) & CAN_RX_BUF_INDEX_MASK);
+        }
+
+        acc += CAN_get_msg(&cm);
+    }
+    sink = acc;
+    BENCH_CHECK(cm.type == H9MSG_TYPE_REG_VALUE && cm.source_id == BENCH_REMOTE_ID && cm.destination_id == BENCH_NODE_ID);
+    BENCH_CHECK(cm.dlc == 3 && cm.data[0] == 0x5a && cm.data[2] == 0x5a);
+}
+
+
+static void bench_isr_rx(uint32_t iterations) {
+    struct can_emu_frame frame;
+    can_emu_frame_set_id(&frame, H9MSG_PRIORITY_LOW, H9MSG_TYPE_DISCOVER, 0, H9MSG_BROADCAST_ID, BENCH_REMOTE_ID);
+    frame.dlc = 0;
+
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < iterations; ++i) {
+        acc += can_emu_receive(&frame);
+        can_rx_buf_bottom = can_rx_buf_top;
+    }
+    sink = acc;
+    BENCH_CHECK(acc == iterations);
+    BENCH_CHECK(can_rx_buf[(uint8_t)((can_rx_buf_top - CAN_BUF_HEADER_SIZE + 1) & CAN_RX_BUF_INDEX_MASK)] == frame.canidt1);
+}
+
+
+// MOb1 and MOb2 both pending, drained by one CAN_INT_vect entry
+static void bench_isr_rx_burst(uint32_t iterations) {
+    struct can_emu_frame broadcast;
+    can_emu_frame_set_id(&broadcast, H9MSG_PRIORITY_LOW, H9MSG_TYPE_DISCOVER, 0, H9MSG_BROADCAST_ID, BENCH_REMOTE_ID);
+    broadcast.dlc = 0;
+    struct can_emu_frame unicast;
+    can_emu_frame_set_id(&unicast, H9MSG_PRIORITY_LOW, H9MSG_TYPE_GET_REG, 0, BENCH_NODE_ID, BENCH_REMOTE_ID);
+    unicast.dlc = 1;
+
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < iterations; ++i) {
+        can_emu_cli();
+        acc += can_emu_receive(&broadcast);
+        acc += can_emu_receive(&unicast);
+        can_emu_sei();
+        BENCH_CHECK(can_rx_buf_top == (uint8_t)((can_rx_buf_bottom + 2 * CAN_BUF_HEADER_SIZE + 1) & CAN_RX_BUF_INDEX_MASK));
+        can_rx_buf_bottom = can_rx_buf_top;
+    }
+    sink = acc;
+    BENCH_CHECK(acc == 2 * iterations);
+}
+
+
+static void bench_put_msg_direct(uint32_t iterations) {
+    h9msg_t cm;
+    CAN_init_new_msg(&cm);
+    cm.type = H9MSG_TYPE_REG_INTERNALLY_CHANGED;
+    cm.destination_id = H9MSG_BROADCAST_ID;
+    cm.dlc = 3;
+
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < iterations; ++i) {
+        cm.data[0] = (uint8_t)i;
+        acc += CAN_put_msg(&cm);
+        BENCH_CHECK(can_emu.mob[0].msg[0] == (uint8_t)i);
+        release_tx_mobs();
+    }
+    sink = acc;
+    BENCH_CHECK(acc == iterations); // every frame straight to MOb0
+}
+
+
+static void bench_put_msg_queued(uint32_t iterations) {
+    h9msg_t cm;
+    CAN_init_new_msg(&cm);
+    cm.type = H9MSG_TYPE_REG_INTERNALLY_CHANGED;
+    cm.destination_id = H9MSG_BROADCAST_ID;
+    cm.dlc = 3;
+
+    occupy_tx_mobs(&cm);
+
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < iterations; ++i) {
+        cm.data[0] = (uint8_t)i;
+        acc += CAN_put_msg(&cm);
+        can_tx_buf_bottom[H9MSG_PRIORITY_LOW] = can_tx_buf_top[H9MSG_PRIORITY_LOW];
+    }
+    sink = acc;
+    BENCH_CHECK(acc == 2 * iterations); // every frame queued
+    release_tx_mobs();
+}
+
+
+static void bench_isr_tx(uint32_t iterations) {
+    h9msg_t cm;
+    CAN_init_new_msg(&cm);
+    cm.type = H9MSG_TYPE_REG_INTERNALLY_CHANGED;
+    cm.destination_id = H9MSG_BROADCAST_ID;
+    cm.dlc = 8;
+
+    occupy_tx_mobs(&cm);
+
+    struct can_emu_frame frame;
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < iterations; ++i) {
+        CAN_put_msg(&cm);
+        acc += can_emu_transmit(&frame);
+    }
+    while (can_emu_transmit(&frame));
+    sink = acc;
+    BENCH_CHECK(acc == iterations);
+    check_frame(&frame, H9MSG_TYPE_REG_INTERNALLY_CHANGED, H9MSG_BROADCAST_ID, 8);
+    BENCH_CHECK(can_tx_buf_top[H9MSG_PRIORITY_LOW] == can_tx_buf_bottom[H9MSG_PRIORITY_LOW]);
+    release_tx_mobs();
+}
+
+
+static void bench_process_get_reg(uint32_t iterations) {
+    h9msg_t cm;
+    cm.priority = H9MSG_PRIORITY_LOW;
+    cm.type = H9MSG_TYPE_GET_REG;
+    cm.seqnum = 0;
+    cm.source_id = BENCH_REMOTE_ID;
+    cm.destination_id = BENCH_NODE_ID;
+    cm.dlc = 1;
+    cm.data[0] = NODE_VERSION_STD_REGISTER;
+
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < iterations; ++i) {
+        acc += process_msg(&cm);
+        release_tx_mobs();
+    }
+    sink = acc;
+    BENCH_CHECK(acc == 0);
+    process_msg(&cm);
+    check_sent(H9MSG_TYPE_REG_VALUE, BENCH_REMOTE_ID, 5, NODE_VERSION_STD_REGISTER);
+    BENCH_CHECK(can_emu.mob[0].msg[2] == 1); // version_major
+}
+
+
+static uint16_t bench_app_value = 0x1234;
+
+static const can_reg_t bench_registers[] PROGMEM = {
+        {2, CAN_REG_READ | CAN_REG_WRITE | CAN_REG_INT, &bench_app_value, NULL, NULL},
+};
+
+
+static void bench_process_get_app_reg(uint32_t iterations) {
+    h9msg_t cm;
+    cm.priority = H9MSG_PRIORITY_LOW;
+    cm.type = H9MSG_TYPE_GET_REG;
+    cm.seqnum = 0;
+    cm.source_id = BENCH_REMOTE_ID;
+    cm.destination_id = BENCH_NODE_ID;
+    cm.dlc = 1;
+    cm.data[0] = CAN_FIRST_APP_REGISTER;
+
+    CAN_set_registers(bench_registers, sizeof(bench_registers) / sizeof(bench_registers[0]));
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < iterations; ++i) {
+        acc += process_msg(&cm);
+        release_tx_mobs();
+    }
+    process_msg(&cm);
+    check_sent(H9MSG_TYPE_REG_VALUE, BENCH_REMOTE_ID, 3, CAN_FIRST_APP_REGISTER);
+    BENCH_CHECK(can_emu.mob[0].msg[1] == 0x12 && can_emu.mob[0].msg[2] == 0x34);
+    CAN_set_registers(NULL, 0);
+    sink = acc;
+    BENCH_CHECK(acc == 0);
+}
+
+
+static void bench_process_discover(uint32_t iterations) {
+    h9msg_t cm;
+    cm.priority = H9MSG_PRIORITY_LOW;
+    cm.type = H9MSG_TYPE_DISCOVER;
+    cm.seqnum = 0;
+    cm.source_id = BENCH_REMOTE_ID;
+    cm.destination_id = H9MSG_BROADCAST_ID;
+    cm.dlc = 0;
+
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < iterations; ++i) {
+        acc += process_msg(&cm);
+        release_tx_mobs();
+    }
+    sink = acc;
+    process_msg(&cm);
+    check_sent(H9MSG_TYPE_NODE_INFO, BENCH_REMOTE_ID, 7, 0x01); // node type 0x0101
+}
+
+
+static void bench_round_trip(uint32_t iterations) {
+    struct can_emu_frame request;
+    can_emu_frame_set_id(&request, H9MSG_PRIORITY_LOW, H9MSG_TYPE_GET_REG, 0, BENCH_NODE_ID, BENCH_REMOTE_ID);
+    request.dlc = 1;
+    request.data[0] = NODE_ID_STD_REGISTER;
+
+    struct can_emu_frame response;
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < iterations; ++i) {
+        can_emu_receive(&request);
+        h9msg_t cm;
+        CAN_get_msg(&cm);
+        acc += can_emu_transmit(&response);
+    }
+    sink = acc;
+    BENCH_CHECK(acc == iterations);
+    check_frame(&response, H9MSG_TYPE_REG_VALUE, BENCH_REMOTE_ID, 3);
+    BENCH_CHECK(response.data[0] == NODE_ID_STD_REGISTER && response.data[2] == (BENCH_NODE_ID & 0xff));
+}
+
+
+static const uint8_t batch_registers[4] = {
+        NODE_ID_STD_REGISTER, NODE_VERSION_STD_REGISTER, NODE_RESET_REASON_STD_REGISTER, NODE_CAN_ERRORS_STD_REGISTER
+};
+// REG_VALUE frames answering them, the CAN errors in two segments
+#define BATCH_RESPONSES (sizeof(batch_registers) + 1)
+
+
+// the same four registers asked for one by one
+static void bench_round_trip_singles(uint32_t iterations) {
+    struct can_emu_frame request;
+    can_emu_frame_set_id(&request, H9MSG_PRIORITY_LOW, H9MSG_TYPE_GET_REG, 0, BENCH_NODE_ID, BENCH_REMOTE_ID);
+    request.dlc = 1;
+
+    struct can_emu_frame response;
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < iterations; ++i) {
+        for (uint8_t reg = 0; reg < sizeof(batch_registers); ++reg) {
+            request.data[0] = batch_registers[reg];
+            can_emu_receive(&request);
+            h9msg_t cm;
+            CAN_get_msg(&cm);
+            while (can_emu_transmit(&response))
+                ++acc;
+        }
+    }
+    sink = acc;
+    BENCH_CHECK(acc == BATCH_RESPONSES * iterations);
+    check_frame(&response, H9MSG_TYPE_REG_VALUE, BENCH_REMOTE_ID, 2 + CAN_ERRORS_REG_SIZE - H9MSG_SEGMENT_VALUE_SIZE);
+    BENCH_CHECK(response.data[0] == NODE_CAN_ERRORS_STD_REGISTER && response.data[1] == (H9MSG_SEGMENT_LAST | 1));
+}
+
+
+// the four registers in one GET_REG
+static void bench_round_trip_batch(uint32_t iterations) {
+    struct can_emu_frame request;
+    can_emu_frame_set_id(&request, H9MSG_PRIORITY_LOW, H9MSG_TYPE_GET_REG, 0, BENCH_NODE_ID, BENCH_REMOTE_ID);
+    request.dlc = sizeof(batch_registers);
+    memcpy(request.data, batch_registers, sizeof(batch_registers));
+
+    struct can_emu_frame response;
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < iterations; ++i) {
+        can_emu_receive(&request);
+        h9msg_t cm;
+        CAN_get_msg(&cm);
+        while (can_emu_transmit(&response))
+            ++acc;
+    }
+    sink = acc;
+    BENCH_CHECK(acc == BATCH_RESPONSES * iterations);
+    check_frame(&response, H9MSG_TYPE_REG_VALUE, BENCH_REMOTE_ID, 2 + CAN_ERRORS_REG_SIZE - H9MSG_SEGMENT_VALUE_SIZE);
+    BENCH_CHECK(response.data[0] == NODE_CAN_ERRORS_STD_REGISTER && response.data[1] == (H9MSG_SEGMENT_LAST | 1));
+}
+
+
+#define BENCH_APP_REGISTER 10
+
+// application register served from an h9msg_t copy of the request
+static void bench_round_trip_app(uint32_t iterations) {
+    struct can_emu_frame request;
+    can_emu_frame_set_id(&request, H9MSG_PRIORITY_LOW, H9MSG_TYPE_GET_REG, 0, BENCH_NODE_ID, BENCH_REMOTE_ID);
+    request.dlc = 1;
+    request.data[0] = BENCH_APP_REGISTER;
+
+    struct can_emu_frame response;
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < iterations; ++i) {
+        can_emu_receive(&request);
+        h9msg_t cm;
+        if (CAN_get_msg(&cm) == 1) {
+            h9msg_t cm_res;
+            CAN_init_response_msg(&cm, &cm_res);
+            cm_res.dlc = 2;
+            cm_res.data[0] = cm.data[0];
+            cm_res.data[1] = (uint8_t)i;
+            CAN_put_msg(&cm_res);
+        }
+        acc += can_emu_transmit(&response);
+    }
+    sink = acc;
+    BENCH_CHECK(acc == iterations);
+    check_frame(&response, H9MSG_TYPE_REG_VALUE, BENCH_REMOTE_ID, 2);
+    BENCH_CHECK(response.data[0] == BENCH_APP_REGISTER && response.data[1] == (uint8_t)(iterations - 1));
+}
+
+
+static void app_frame_handler(const can_frame_t *frame, uint8_t kind) {
+    can_tx_frame_t tx;
+    if (kind == 1 && CAN_reserve_response(frame, &tx, 2)) {
+        CAN_set_tx_frame_data(&tx, 0, CAN_frame_data(frame, 0));
+        CAN_set_tx_frame_data(&tx, 1, (uint8_t)sink);
+        CAN_commit_msg(&tx);
+    }
+}
+
+
+// the same served in place by CAN_dispatch
+static void bench_round_trip_app_dispatch(uint32_t iterations) {
+    struct can_emu_frame request;
+    can_emu_frame_set_id(&request, H9MSG_PRIORITY_LOW, H9MSG_TYPE_GET_REG, 0, BENCH_NODE_ID, BENCH_REMOTE_ID);
+    request.dlc = 1;
+    request.data[0] = BENCH_APP_REGISTER;
+
+    CAN_set_frame_handler(app_frame_handler);
+    struct can_emu_frame response;
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < iterations; ++i) {
+        can_emu_receive(&request);
+        CAN_dispatch();
+        acc += can_emu_transmit(&response);
+    }
+    CAN_set_frame_handler(NULL);
+    sink = acc;
+    BENCH_CHECK(acc == iterations);
+    check_frame(&response, H9MSG_TYPE_REG_VALUE, BENCH_REMOTE_ID, 2);
+    BENCH_CHECK(response.data[0] == BENCH_APP_REGISTER);
+}
+
+
+// a SET_REG of an application register straight into the rx ring, the answer stays in the tx queue
+static void put_app_set_reg(uint32_t i) {
+    struct can_emu_frame frame;
+    can_emu_frame_set_id(&frame, H9MSG_PRIORITY_LOW, H9MSG_TYPE_SET_REG, 0, BENCH_NODE_ID, BENCH_REMOTE_ID);
+    uint8_t top = can_rx_buf_top;
+    const uint8_t header[CAN_BUF_HEADER_SIZE] = {8, frame.canidt1, frame.canidt2, frame.canidt3, frame.canidt4};
+    for (uint8_t idx = 0; idx < CAN_BUF_HEADER_SIZE; ++idx) {
+        can_rx_buf[top] = header[idx];
+        top = (uint8_t)((top + 1) & CAN_RX_BUF_INDEX_MASK);
+    }
+    for (uint8_t idx = 0; idx < 8; ++idx) {
+        can_rx_buf[top] = idx ? (uint8_t)(i + idx) : BENCH_APP_REGISTER;
+        top = (uint8_t)((top + 1) & CAN_RX_BUF_INDEX_MASK);
+    }
+    can_rx_buf_top = top;
+}
+
+
+static void check_app_set_reg_answer(uint32_t i) {
+    uint8_t bottom = can_tx_buf_bottom[H9MSG_PRIORITY_LOW];
+    BENCH_CHECK(can_tx_buf_top[H9MSG_PRIORITY_LOW] == (uint8_t)((bottom + CAN_BUF_HEADER_SIZE + 8) & CAN_TX_BUF_INDEX_MASK));
+    BENCH_CHECK(((can_tx_buf[H9MSG_PRIORITY_LOW][(uint8_t)((bottom + 1) & CAN_TX_BUF_INDEX_MASK)] >> 2) & 0x1f) == H9MSG_TYPE_REG_EXTERNALLY_CHANGED);
+    BENCH_CHECK(can_tx_buf[H9MSG_PRIORITY_LOW][(uint8_t)((bottom + CAN_BUF_HEADER_SIZE + 7) & CAN_TX_BUF_INDEX_MASK)] == (uint8_t)(i + 7));
+}
+
+
+// the driver half of an application SET_REG with an 8-byte value: CAN_get_msg copies, CAN_put_msg answers
+static void bench_app_set_reg(uint32_t iterations) {
+    h9msg_t cm;
+    CAN_init_new_msg(&cm);
+    occupy_tx_mobs(&cm);
+    can_tx_buf_bottom[H9MSG_PRIORITY_LOW] = can_tx_buf_top[H9MSG_PRIORITY_LOW];
+
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < iterations; ++i) {
+        put_app_set_reg(i);
+        if (CAN_get_msg(&cm) == 1) {
+            h9msg_t cm_res;
+            CAN_init_response_msg(&cm, &cm_res);
+            cm_res.dlc = cm.dlc;
+            memcpy(cm_res.data, cm.data, cm.dlc);
+            acc += CAN_put_msg(&cm_res);
+        }
+        check_app_set_reg_answer(i);
+        can_tx_buf_bottom[H9MSG_PRIORITY_LOW] = can_tx_buf_top[H9MSG_PRIORITY_LOW];
+    }
+    sink = acc;
+    BENCH_CHECK(acc == 2 * iterations);
+    release_tx_mobs();
+}
+
+
+static void app_set_reg_handler(const can_frame_t *frame, uint8_t kind) {
+    can_tx_frame_t tx;
+    uint8_t dlc = CAN_frame_dlc(frame);
+    if (kind == 1 && CAN_reserve_response(frame, &tx, dlc)) {
+        for (uint8_t idx = 0; idx < dlc; ++idx)
+            CAN_set_tx_frame_data(&tx, idx, CAN_frame_data(frame, idx));
+        sink += CAN_commit_msg(&tx);
+    }
+}
+
+
+// the same in place: CAN_dispatch and the reserved answer
+static void bench_app_set_reg_dispatch(uint32_t iterations) {
+    h9msg_t cm;
+    CAN_init_new_msg(&cm);
+    occupy_tx_mobs(&cm);
+    can_tx_buf_bottom[H9MSG_PRIORITY_LOW] = can_tx_buf_top[H9MSG_PRIORITY_LOW];
+
+    CAN_set_frame_handler(app_set_reg_handler);
+    sink = 0;
+    for (uint32_t i = 0; i < iterations; ++i) {
+        put_app_set_reg(i);
+        CAN_dispatch();
+        check_app_set_reg_answer(i);
+        can_tx_buf_bottom[H9MSG_PRIORITY_LOW] = can_tx_buf_top[H9MSG_PRIORITY_LOW];
+    }
+    CAN_set_frame_handler(NULL);
+    BENCH_CHECK(sink == 2 * iterations);
+    release_tx_mobs();
+}
+
+
+// six numbered frames: four in the tx MObs, two queued
+static void put_numbered_frames(void) {
+    h9msg_t cm;
+    CAN_init_new_msg(&cm);
+    cm.type = H9MSG_TYPE_REG_INTERNALLY_CHANGED;
+    cm.destination_id = H9MSG_BROADCAST_ID;
+    cm.dlc = 1;
+    for (uint8_t i = 0; i < 6; ++i) {
+        cm.data[0] = i;
+        BENCH_CHECK(CAN_put_msg(&cm));
+    }
+}
+
+
+static void check_numbered_frames_sent(void) {
+    struct can_emu_frame frame;
+    for (uint8_t i = 0; i < 6; ++i) {
+        BENCH_CHECK(can_emu_transmit(&frame));
+        check_frame(&frame, H9MSG_TYPE_REG_INTERNALLY_CHANGED, H9MSG_BROADCAST_ID, 1);
+        BENCH_CHECK(frame.data[0] == i);
+    }
+    BENCH_CHECK(!can_emu_transmit(&frame));
+}
+
+
+// a remote node filter takes a tx MOb with a frame loaded at once, the frames still go in order
+static void check_rx_filter_on_busy_mob(void) {
+    setup();
+    put_numbered_frames();
+    CAN_set_mob_for_remote_node1(BENCH_REMOTE_ID, 1);
+    BENCH_CHECK(!(can_tx_mobs & (1 << 3)));
+    BENCH_CHECK((can_emu.mob[3].cancdmob & ((1 << CONMOB1) | (1 << CONMOB0))) == (1 << CONMOB1));
+    check_numbered_frames_sent();
+}
+
+
+// the same for the MObs stopped by a bus off, none of them transmits once it is a filter
+static void check_rx_filter_after_bus_off(void) {
+    setup();
+    put_numbered_frames();
+    can_emu.cangsta |= 1 << BOFF;
+    can_emu_general_irq(1 << BOFFIT);
+    BENCH_CHECK(requeue_mobs);
+    CAN_set_mob_for_remote_node1(BENCH_REMOTE_ID, 1);
+    BENCH_CHECK(!requeue_mobs);
+    can_emu.cangsta &= ~(1 << BOFF);
+    while (bus_off_hold)
+        can_emu_general_irq(1 << OVRTIM);
+    BENCH_CHECK((can_emu.mob[3].cancdmob & ((1 << CONMOB1) | (1 << CONMOB0))) == (1 << CONMOB1));
+    check_numbered_frames_sent();
+}
+
+
+// a remote node frame to some other node, 0xff - no rx MOb takes it, otherwise the CAN_get_msg return value
+static uint8_t receive_remote(uint16_t source_id, uint8_t type) {
+    struct can_emu_frame frame;
+    can_emu_frame_set_id(&frame, H9MSG_PRIORITY_LOW, type, 0, 0x077, source_id);
+    frame.dlc = 1;
+    frame.data[0] = 0x5a;
+    if (!can_emu_receive(&frame))
+        return 0xff;
+    h9msg_t cm;
+    uint8_t ret = CAN_get_msg(&cm);
+    BENCH_CHECK(can_rx_buf_top == can_rx_buf_bottom);
+    if (ret == 2)
+        BENCH_CHECK(cm.source_id == source_id && cm.type == type && cm.data[0] == 0x5a);
+    return ret;
+}
+
+
+// over max_mobs the closest sources share a MOb, what that filter lets through beyond the list is dropped
+static void check_subscribe_merged(void) {
+    setup();
+    static const can_subscription_t list[] = {{0x030, 0}, {0x100, 0}, {0x033, 0}};
+    // 0x030 and 0x033 go to 0x030..0x033: two sources too many, 8 response types each
+    BENCH_CHECK(CAN_subscribe(list, 3, 2) == 2 * 8);
+    BENCH_CHECK((can_tx_mobs & ((1 << 3) | (1 << 4) | (1 << 5))) == 1 << 5);
+    BENCH_CHECK(receive_remote(0x030, H9MSG_TYPE_REG_VALUE) == 2);
+    BENCH_CHECK(receive_remote(0x033, H9MSG_TYPE_REG_EXTERNALLY_CHANGED) == 2);
+    BENCH_CHECK(receive_remote(0x100, H9MSG_TYPE_NODE_HEARTBEAT) == 2);
+    BENCH_CHECK(receive_remote(0x031, H9MSG_TYPE_REG_VALUE) == 0);
+    BENCH_CHECK(receive_remote(0x032, H9MSG_TYPE_ERROR) == 0);
+    BENCH_CHECK(receive_remote(0x034, H9MSG_TYPE_REG_VALUE) == 0xff);
+    BENCH_CHECK(receive_remote(0x101, H9MSG_TYPE_REG_VALUE) == 0xff);
+    BENCH_CHECK(receive_remote(0x030, H9MSG_TYPE_NODE_SPECIFIC_BULK1) == 0xff);
+}
+
+
+// exact filters need no software part, count 0 gives MOb3-5 back to transmit
+static void check_subscribe_release(void) {
+    setup();
+    static const can_subscription_t list[] = {{0x030, 1}, {0x100, 0}, {0x033, 0}};
+    BENCH_CHECK(CAN_subscribe(list, 3, 3) == 0);
+    BENCH_CHECK(can_tx_mobs == (1 << 0));
+    BENCH_CHECK(receive_remote(0x030, H9MSG_TYPE_NODE_SPECIFIC_BULK1) == 2);
+    BENCH_CHECK(receive_remote(0x033, H9MSG_TYPE_REG_VALUE) == 2);
+    BENCH_CHECK(receive_remote(0x033, H9MSG_TYPE_NODE_SPECIFIC_BULK1) == 0xff);
+    BENCH_CHECK(receive_remote(0x031, H9MSG_TYPE_REG_VALUE) == 0xff);
+
+    BENCH_CHECK(CAN_subscribe(NULL, 0, 3) == 0);
+    BENCH_CHECK(can_tx_mobs == CAN_TX_MOB_POOL);
+    BENCH_CHECK(receive_remote(0x030, H9MSG_TYPE_REG_VALUE) == 0xff);
+    h9msg_t cm;
+    CAN_init_new_msg(&cm);
+    cm.type = H9MSG_TYPE_REG_INTERNALLY_CHANGED;
+    cm.destination_id = H9MSG_BROADCAST_ID;
+    cm.dlc = 0;
+    uint8_t loaded = 0;
+    while (CAN_put_msg(&cm) == 1)
+        ++loaded;
+    BENCH_CHECK(loaded == 4);
+}
+
+
+// CAN_dispatch without a handler counts the application frames it drops
+static void check_dispatch_without_handler(void) {
+    setup();
+    put_app_set_reg(0);
+    BENCH_CHECK(CAN_dispatch() == 1 && can_rx_buf_top == can_rx_buf_bottom);
+    BENCH_CHECK(can_stats.rx_unhandled == 1);
+    struct can_emu_frame frame;
+    BENCH_CHECK(!can_emu_transmit(&frame));
+}
+
+
+// a reserved tx queue takes no other frame, the unloaded MObs go below the reserved frame
+static void check_reserved_queue(void) {
+    setup();
+    put_numbered_frames();
+    can_tx_frame_t tx;
+    BENCH_CHECK(CAN_reserve_msg(&tx, H9MSG_PRIORITY_LOW, 8));
+    tx.type = H9MSG_TYPE_REG_INTERNALLY_CHANGED;
+    tx.destination_id = H9MSG_BROADCAST_ID;
+    for (uint8_t idx = 0; idx < 8; ++idx)
+        CAN_set_tx_frame_data(&tx, idx, 0xa5);
+
+    h9msg_t cm;
+    CAN_init_new_msg(&cm);
+    cm.type = H9MSG_TYPE_REG_INTERNALLY_CHANGED;
+    cm.destination_id = H9MSG_BROADCAST_ID;
+    cm.dlc = 1;
+    BENCH_CHECK(!CAN_put_msg(&cm) && can_stats.tx_drops == 1);
+    can_tx_frame_t other;
+    BENCH_CHECK(!CAN_reserve_msg(&other, H9MSG_PRIORITY_LOW, 1));
+    CAN_set_mob_for_remote_node1(BENCH_REMOTE_ID, 1);
+    BENCH_CHECK(CAN_commit_msg(&tx) == 2);
+
+    for (uint8_t i = 0; i < 6; ++i)
+        check_sent(H9MSG_TYPE_REG_INTERNALLY_CHANGED, H9MSG_BROADCAST_ID, 1, i);
+    check_sent(H9MSG_TYPE_REG_INTERNALLY_CHANGED, H9MSG_BROADCAST_ID, 8, 0xa5);
+    BENCH_CHECK(CAN_put_msg(&cm) == 1);
+}
+
+
+// a batched GET_REG while the previous batch waits for the tx queue is refused, the first one completes
+static void check_batch_busy(void) {
+    setup();
+    put_numbered_frames();
+    struct can_emu_frame request;
+    can_emu_frame_set_id(&request, H9MSG_PRIORITY_LOW, H9MSG_TYPE_GET_REG, 1, BENCH_NODE_ID, BENCH_REMOTE_ID);
+    const uint8_t registers[] = {
+            NODE_CAN_ERRORS_STD_REGISTER, NODE_ID_STD_REGISTER, NODE_VERSION_STD_REGISTER, NODE_TYPE_STD_REGISTER,
+            NODE_HARDWARE_REVISION_STD_REGISTER, NODE_RESET_REASON_STD_REGISTER, NODE_CAN_STATS_STD_REGISTER
+    };
+    request.dlc = sizeof(registers);
+    memcpy(request.data, registers, sizeof(registers));
+    can_emu_receive(&request);
+    drain_rx();
+    BENCH_CHECK(tx_batch.next < tx_batch.req.dlc);
+    can_emu_frame_set_id(&request, H9MSG_PRIORITY_LOW, H9MSG_TYPE_GET_REG, 2, BENCH_NODE_ID, BENCH_REMOTE_ID);
+    can_emu_receive(&request);
+    drain_rx();
+
+    struct can_emu_frame frame;
+    uint8_t values = 0;
+    uint8_t busy = 0;
+    while (can_emu_transmit(&frame)) {
+        uint8_t type = (frame.canidt1 >> 2) & 0x1f;
+        uint8_t seqnum = ((frame.canidt1 << 3) & 0x18) | ((frame.canidt2 >> 5) & 0x07);
+        if (type == H9MSG_TYPE_REG_VALUE && seqnum == 1)
+            ++values;
+        else if (type == H9MSG_TYPE_ERROR && seqnum == 2 && frame.data[0] == H9FRAME_ERROR_BUSY)
+            ++busy;
+        else
+            BENCH_CHECK(type == H9MSG_TYPE_REG_INTERNALLY_CHANGED);
+        drain_rx();
+    }
+    BENCH_CHECK(values == sizeof(registers) + 1 && busy == 1 && tx_batch.next == tx_batch.req.dlc);
+}
+
+
+// the CAN stats fit one frame, the frame counters saturate, the error counters come in two segments
+static void check_stats_registers(void) {
+    setup();
+    CAN_clear_stats();
+    can_stats.rx_frames = UINT16_MAX;
+    can_stats.bit_errors = 300;
+    struct can_emu_frame request;
+    can_emu_frame_set_id(&request, H9MSG_PRIORITY_LOW, H9MSG_TYPE_GET_REG, 0, BENCH_NODE_ID, BENCH_REMOTE_ID);
+    request.dlc = 1;
+    request.data[0] = NODE_CAN_STATS_STD_REGISTER;
+    can_emu_receive(&request);
+    drain_rx();
+    struct can_emu_frame frame;
+    BENCH_CHECK(can_emu_transmit(&frame));
+    check_frame(&frame, H9MSG_TYPE_REG_VALUE, BENCH_REMOTE_ID, 1 + CAN_STATS_REG_SIZE);
+    BENCH_CHECK(frame.data[0] == NODE_CAN_STATS_STD_REGISTER && frame.data[1] == 0xff && frame.data[2] == 0xff);
+    BENCH_CHECK(frame.data[3] == 0 && frame.data[4] == 0);
+
+    request.data[0] = NODE_CAN_ERRORS_STD_REGISTER;
+    can_emu_receive(&request);
+    drain_rx();
+    BENCH_CHECK(can_emu_transmit(&frame));
+    check_frame(&frame, H9MSG_TYPE_REG_VALUE, BENCH_REMOTE_ID, 2 + H9MSG_SEGMENT_VALUE_SIZE);
+    BENCH_CHECK(frame.data[0] == NODE_CAN_ERRORS_STD_REGISTER && frame.data[1] == 0 && frame.data[2 + 4] == 0xff);
+    BENCH_CHECK(can_emu_transmit(&frame));
+    check_frame(&frame, H9MSG_TYPE_REG_VALUE, BENCH_REMOTE_ID, 2 + CAN_ERRORS_REG_SIZE - H9MSG_SEGMENT_VALUE_SIZE);
+    BENCH_CHECK(frame.data[1] == (H9MSG_SEGMENT_LAST | 1));
+    BENCH_CHECK(!can_emu_transmit(&frame));
+    BENCH_CHECK(can_stats.rx_frames == UINT16_MAX && can_stats.tx_frames == 3);
+}
+
+
+// the stopped frames go out in order once the controller is back from bus off
+static void check_bus_off_recovery(void) {
+    setup();
+    put_numbered_frames();
+    can_emu.cangsta |= 1 << BOFF;
+    can_emu_general_irq(1 << BOFFIT);
+    struct can_emu_frame frame;
+    BENCH_CHECK(!can_emu_transmit(&frame));
+    for (uint8_t tick = 0; tick < 8; ++tick)
+        can_emu_general_irq(1 << OVRTIM);
+    BENCH_CHECK(bus_off_hold && !can_emu_transmit(&frame));
+    can_emu.cangsta &= ~(1 << BOFF);
+    can_emu_general_irq(1 << OVRTIM);
+    BENCH_CHECK(!bus_off_hold && !(CANGIE & (1 << ENOVRT)));
+    BENCH_CHECK(can_emu.swres_count == 1); // CAN_init only
+    check_numbered_frames_sent();
+}
+
+
+// a controller stuck in bus off is reset, the remote node filter and the frames survive it
+static void check_bus_off_restart(void) {
+    setup();
+    CAN_set_mob_for_remote_node1(BENCH_REMOTE_ID, 1);
+    struct can_emu_mob filter = can_emu.mob[3];
+    put_numbered_frames();
+    can_emu.cangsta |= 1 << BOFF;
+    can_emu.cantec = 255;
+    can_emu_general_irq(1 << BOFFIT);
+    uint16_t ticks = 0;
+    while (bus_off_hold && ++ticks < 1000)
+        can_emu_general_irq(1 << OVRTIM);
+    BENCH_CHECK(ticks == CAN_BUS_OFF_BACKOFF_MIN + CAN_BUS_OFF_RESTART_TICKS - 1);
+    BENCH_CHECK(can_emu.swres_count == 2 && !(can_emu.cangsta & (1 << BOFF)) && !can_emu.cantec);
+    BENCH_CHECK(can_emu.mob[3].cancdmob == filter.cancdmob && can_emu.mob[3].canidt4 == filter.canidt4
+                && can_emu.mob[3].canidm1 == filter.canidm1 && can_emu.mob[3].canidm4 == filter.canidm4);
+    check_numbered_frames_sent();
+}
+
+
+// the reset lands in CAN_put_msg on a nearly full queue, the frame put keeps its bytes
+static void check_bus_off_restart_in_put(void) {
+    setup();
+    h9msg_t cm;
+    CAN_init_new_msg(&cm);
+    cm.type = H9MSG_TYPE_REG_INTERNALLY_CHANGED;
+    cm.destination_id = H9MSG_BROADCAST_ID;
+    cm.dlc = 8;
+    memset(cm.data, 0, sizeof(cm.data));
+    BENCH_CHECK(CAN_put_msg(&cm) == 1);
+    can_emu.cangsta |= 1 << BOFF;
+    can_emu_general_irq(1 << BOFFIT);
+    BENCH_CHECK(requeue_mobs == 1);
+    // the queue takes one more frame, the stopped one does not fit next to it
+    uint8_t queued = 0;
+    while (tx_space(H9MSG_PRIORITY_LOW) >= 2 * (CAN_BUF_HEADER_SIZE + 8)) {
+        memset(cm.data, ++queued, sizeof(cm.data));
+        BENCH_CHECK(CAN_put_msg(&cm) == 2);
+    }
+    while (bus_off_stuck < CAN_BUS_OFF_RESTART_TICKS - 1)
+        can_emu_general_irq(1 << OVRTIM);
+    uint16_t drops = can_stats.tx_drops;
+
+    barrier_cangit = 1 << OVRTIM;
+    memset(cm.data, ++queued, sizeof(cm.data));
+    BENCH_CHECK(CAN_put_msg(&cm) == 2);
+    can_emu_service();
+    BENCH_CHECK(!barrier_cangit && !bus_off_hold && can_emu.swres_count == 2);
+    BENCH_CHECK(can_stats.tx_drops == drops + 1);
+
+    struct can_emu_frame frame;
+    for (uint8_t i = 1; i <= queued; ++i) {
+        BENCH_CHECK(can_emu_transmit(&frame));
+        check_frame(&frame, H9MSG_TYPE_REG_INTERNALLY_CHANGED, H9MSG_BROADCAST_ID, 8);
+        for (uint8_t idx = 0; idx < 8; ++idx)
+            BENCH_CHECK(frame.data[idx] == i);
+    }
+    BENCH_CHECK(!can_emu_transmit(&frame));
+}
+
+
+static uint8_t bulk_received[512];
+static uint16_t bulk_received_length;
+static uint8_t bulk_closed;
+
+static void bulk_handler(uint16_t source_id, const uint8_t *data, uint8_t length) {
+    BENCH_CHECK(source_id == BENCH_NODE_ID);
+    if (!length) {
+        ++bulk_closed;
+        return;
+    }
+    BENCH_CHECK(bulk_received_length + length <= sizeof(bulk_received));
+    memcpy(bulk_received + bulk_received_length, data, length);
+    bulk_received_length += length;
+}
+
+
+// what went over the bus of a stream the node sends to itself
+struct bulk_trace {
+    uint8_t drop_seq; // the data frame lost once
+    uint8_t dropped;
+    uint8_t resent;
+    uint8_t resend_seq; // data[1] of the last RESEND
+    uint8_t ops;        // 1 << H9MSG_BULK_* of the control frames seen
+    uint16_t frames;
+};
+
+
+static uint8_t frame_bulk_seq(const struct can_emu_frame *frame) {
+    uint8_t type = (frame->canidt1 >> 2) & 0x1f;
+    uint8_t seqnum = ((frame->canidt1 << 3) & 0x18) | ((frame->canidt2 >> 5) & 0x07);
+    return (type - H9MSG_TYPE_NODE_SPECIFIC_BULK1) * 32 + seqnum;
+}
+
+
+static void bulk_loopback(struct bulk_trace *trace) {
+    struct can_emu_frame frame;
+    while (can_emu_transmit(&frame)) {
+        ++trace->frames;
+        if (((frame.canidt1 >> 2) & 0x1f) == H9MSG_TYPE_NODE_SPECIFIC_BULK0) {
+            trace->ops |= 1 << frame.data[0];
+            if (frame.data[0] == H9MSG_BULK_RESEND)
+                trace->resend_seq = frame.data[1];
+        }
+        else if (frame_bulk_seq(&frame) == trace->drop_seq) {
+            if (!trace->dropped) {
+                trace->dropped = 1;
+                continue;
+            }
+            trace->resent = 1;
+        }
+        can_emu_receive(&frame);
+        drain_rx();
+    }
+    drain_rx();
+}
+
+
+// a stream fills the receiver's window, a lost frame comes again on RESEND, the close goes through
+static void check_bulk_stream(void) {
+    setup();
+    bulk_received_length = 0;
+    bulk_closed = 0;
+    CAN_bulk_listen(bulk_handler);
+    static uint8_t buf[256];
+    uint8_t data[400];
+    for (uint16_t i = 0; i < sizeof(data); ++i)
+        data[i] = (uint8_t)(i * 7 + 1);
+
+    struct bulk_trace trace = {.drop_seq = 3};
+    BENCH_CHECK(CAN_bulk_open(BENCH_NODE_ID, buf, sizeof(buf)));
+    bulk_loopback(&trace);
+    BENCH_CHECK(CAN_bulk_state() == CAN_BULK_OPEN && trace.ops == ((1 << H9MSG_BULK_OPEN) | (1 << H9MSG_BULK_CREDIT)));
+    uint16_t written = CAN_bulk_write(data, sizeof(data));
+    BENCH_CHECK(written == sizeof(buf));
+
+    // the receiver sees nothing yet, the sender stops at the window
+    struct can_emu_frame held[CAN_BULK_WINDOW_MAX + 1];
+    uint8_t count = 0;
+    while (count <= CAN_BULK_WINDOW_MAX && can_emu_transmit(&held[count])) {
+        BENCH_CHECK(frame_bulk_seq(&held[count]) == count);
+        check_frame(&held[count], H9MSG_TYPE_NODE_SPECIFIC_BULK1, BENCH_NODE_ID, 8);
+        ++count;
+        drain_rx();
+    }
+    BENCH_CHECK(count == CAN_BULK_RX_WINDOW && bulk_tx.window == CAN_BULK_RX_WINDOW);
+
+    for (uint8_t i = 0; i < count; ++i) {
+        if (i == trace.drop_seq)
+            continue;
+        can_emu_receive(&held[i]);
+        drain_rx();
+    }
+    trace.dropped = 1;
+    BENCH_CHECK(bulk_received_length == trace.drop_seq * 8);
+
+    uint16_t idle = 0;
+    while ((written < sizeof(data) || CAN_bulk_pending()) && idle < 100) {
+        written += CAN_bulk_write(data + written, sizeof(data) - written);
+        uint16_t frames = trace.frames;
+        bulk_loopback(&trace);
+        if (frames == trace.frames) {
+            ++idle;
+            can_emu_general_irq(1 << OVRTIM);
+        }
+    }
+    BENCH_CHECK((trace.ops & (1 << H9MSG_BULK_RESEND)) && trace.resend_seq == trace.drop_seq && trace.resent);
+    BENCH_CHECK(bulk_received_length == sizeof(data) && !memcmp(bulk_received, data, sizeof(data)));
+
+    CAN_bulk_close();
+    bulk_loopback(&trace);
+    BENCH_CHECK((trace.ops & (1 << H9MSG_BULK_CLOSE)) && (trace.ops & (1 << H9MSG_BULK_CLOSED)));
+    BENCH_CHECK(CAN_bulk_state() == CAN_BULK_CLOSED && bulk_closed == 1 && bulk_rx.source_id == H9MSG_BROADCAST_ID);
+    can_emu_general_irq(1 << OVRTIM);
+    BENCH_CHECK(!(CANGIE & (1 << ENOVRT)));
+}
+
+
+// with no receiver on the bus the sender gives the stream up after the retries
+static void check_bulk_no_peer(void) {
+    setup();
+    static uint8_t buf[64];
+    const uint8_t data[16] = {0};
+    BENCH_CHECK(CAN_bulk_open(BENCH_REMOTE_ID, buf, sizeof(buf)));
+    BENCH_CHECK(CAN_bulk_write(data, sizeof(data)) == sizeof(data));
+
+    struct can_emu_frame frame;
+    h9msg_t cm;
+    uint8_t opens = 0;
+    uint16_t ticks = 0;
+    while (CAN_bulk_state() != CAN_BULK_CLOSED && ticks < 1000) {
+        while (can_emu_transmit(&frame)) {
+            check_frame(&frame, H9MSG_TYPE_NODE_SPECIFIC_BULK0, BENCH_REMOTE_ID, 1);
+            BENCH_CHECK(frame.data[0] == H9MSG_BULK_OPEN);
+            ++opens;
+        }
+        can_emu_general_irq(1 << OVRTIM);
+        ++ticks;
+        CAN_get_msg(&cm);
+    }
+    BENCH_CHECK(opens == CAN_BULK_RETRIES + 1 && ticks == (CAN_BULK_RETRIES + 1) * CAN_BULK_TIMEOUT);
+    BENCH_CHECK(!can_emu_transmit(&frame));
+    can_emu_general_irq(1 << OVRTIM);
+    BENCH_CHECK(!(CANGIE & (1 << ENOVRT)));
+}
+
+
+static void run(const char *name, bench_fn_t fn, uint32_t iterations, uint8_t frames_per_call) {
+    setup();
+    fn(iterations / 10 + 1); // warm up
+    setup();
+
+    double start = now_ns();
+    fn(iterations);
+    double elapsed = now_ns() - start;
+
+    double ns_per_call = elapsed / iterations;
+    printf("%-36s %10u %10.1f %14.0f", name, iterations, ns_per_call, 1e9 / ns_per_call);
+    if (frames_per_call)
+        printf(" %14.0f", frames_per_call * 1e9 / ns_per_call);
+    printf("\n");
+}
+
+
+int main(int argc, char **argv) {
+    uint32_t iterations = 1000000;
+    if (argc > 1) {
+        iterations = (uint32_t)strtoul(argv[1], NULL, 0);
+        if (!iterations) {
+            fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    check_rx_filter_on_busy_mob();
+    check_rx_filter_after_bus_off();
+    check_subscribe_merged();
+    check_subscribe_release();
+    check_dispatch_without_handler();
+    check_reserved_queue();
+    check_batch_busy();
+    check_stats_registers();
+    check_bus_off_recovery();
+    check_bus_off_restart();
+    check_bus_off_restart_in_put();
+    check_bulk_stream();
+    check_bulk_no_peer();
+
+    printf("%-36s %10s %10s %14s %14s\n", "benchmark", "calls", "ns/call", "calls/s", "frames/s");
+    run("encode calc_can_id1..4", bench_calc_can_id, iterations, 0);
+    run("decode CAN_get_msg", bench_decode, iterations, 1);
+    run("rx ring push CAN_INT_vect", bench_isr_rx, iterations, 1);
+    run("rx burst of 2 CAN_INT_vect", bench_isr_rx_burst, iterations, 2);
+    run("tx CAN_put_msg direct", bench_put_msg_direct, iterations, 1);
+    run("tx ring push CAN_put_msg", bench_put_msg_queued, iterations, 1);
+    run("tx ring pop CAN_INT_vect", bench_isr_tx, iterations, 1);
+    run("dispatch process_msg GET_REG", bench_process_get_reg, iterations, 0);
+    run("dispatch process_msg GET_REG table", bench_process_get_app_reg, iterations, 0);
+    run("dispatch process_msg DISCOVER", bench_process_discover, iterations, 0);
+    run("round trip GET_REG", bench_round_trip, iterations, 2);
+    run("round trip 4 single GET_REGs", bench_round_trip_singles, iterations, sizeof(batch_registers) + BATCH_RESPONSES);
+    run("round trip batched GET_REG of 4", bench_round_trip_batch, iterations, 1 + BATCH_RESPONSES);
+    run("round trip app GET_REG CAN_get_msg", bench_round_trip_app, iterations, 2);
+    run("round trip app GET_REG CAN_dispatch", bench_round_trip_app_dispatch, iterations, 2);
+    run("app SET_REG of 8 CAN_get_msg", bench_app_set_reg, iterations, 2);
+    run("app SET_REG of 8 CAN_dispatch", bench_app_set_reg_dispatch, iterations, 2);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,278 @@
+// SPDX-License-Identifier: MIT
+/*
+ * H9 CAN host build - emulated AVR CAN controller
+ *
+ * Copyright (C) 2024 Kamil Pałkowski
+ *
+ */
+
+#include "can_emu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avr/io.h>
+
+#define CAN_EMU_MAX_NESTED_IRQ 64
+
+struct can_emu can_emu;
+
+
+struct can_emu_mob *can_emu_page_mob(void) {
+    uint8_t mob = can_emu.canpage >> MOBNB0;
+    if (mob >= CAN_EMU_MOB_COUNT) {
+        fprintf(stderr, "can_emu: CANPAGE selects not existing MOb %u\n", mob);
+        abort();
+    }
+    return &can_emu.mob[mob];
+}
+
+
+uint8_t *can_emu_msg(void) {
+    struct can_emu_mob *mob = can_emu_page_mob();
+    uint8_t indx = can_emu.canpage & 0x07;
+    if (!(can_emu.canpage & (1 << AINC))) {
+        can_emu.canpage = (can_emu.canpage & 0xf8) | ((indx + 1) & 0x07);
+    }
+    return &mob->msg[indx];
+}
+
+
+uint8_t can_emu_hpmob(void) {
+    for (uint8_t mob = 0; mob < CAN_EMU_MOB_COUNT; ++mob) {
+        if ((can_emu.canie2 & (1 << mob)) && can_emu.mob[mob].canstmob) {
+            return (uint8_t)(mob << 4);
+        }
+    }
+    return 0xf0;
+}
+
+
+uint8_t can_emu_en2(void) {
+    uint8_t en2 = 0;
+    for (uint8_t mob = 0; mob < CAN_EMU_MOB_COUNT; ++mob) {
+        if ((can_emu.mob[mob].cancdmob & ((1 << CONMOB1) | (1 << CONMOB0)))
+            && !(can_emu.mob[mob].canstmob & ((1 << TXOK) | (1 << RXOK)))) {
+            en2 |= 1 << mob;
+        }
+    }
+    return en2;
+}
+
+
+static uint8_t *ee_cell(void) {
+    if (can_emu.eear <= E2END)
+        return &can_emu.eeprom[can_emu.eear];
+    return (uint8_t *)can_emu.eear;
+}
+
+
+static void ee_complete(void) {
+    if (can_emu.eecr & (1 << EERE)) {
+        can_emu.eedr = *ee_cell();
+        can_emu.eecr &= ~(1 << EERE);
+    }
+    if (can_emu.eecr & (1 << EEPE)) {
+        if (!(can_emu.eecr & (1 << EEMPE))) {
+            fprintf(stderr, "can_emu: EEPE set without EEMPE\n");
+            abort();
+        }
+        *ee_cell() = can_emu.eedr;
+        can_emu.eecr &= ~((1 << EEPE) | (1 << EEMPE));
+    }
+}
+
+
+uint8_t *can_emu_eecr(void) {
+    ee_complete();
+    return &can_emu.eecr;
+}
+
+
+uint8_t *can_emu_eedr(void) {
+    ee_complete();
+    return &can_emu.eedr;
+}
+
+
+uint8_t *can_emu_cangie(void) {
+    // the interrupts enabled by the previous write, the chip takes them right after it
+    can_emu_service();
+    return &can_emu.cangie;
+}
+
+
+uint8_t *can_emu_cangcon(void) {
+    if (can_emu.cangcon & (1 << SWRES)) {
+        // the general status only, the driver sets up CANGIE and the MObs after the reset anyway
+        can_emu.cangcon = 0;
+        can_emu.cangsta = 0;
+        can_emu.cangit = 0;
+        can_emu.cantec = 0;
+        can_emu.canrec = 0;
+        can_emu.cantim = 0;
+        ++can_emu.swres_count;
+    }
+    return &can_emu.cangcon;
+}
+
+
+__attribute__((weak)) void can_emu_ee_ready_vect(void) {
+    can_emu.eecr &= ~(1 << EERIE);
+}
+
+
+void can_emu_sei(void) {
+    can_emu.sreg |= 1 << SREG_I;
+    can_emu_service();
+}
+
+
+void can_emu_cli(void) {
+    can_emu.sreg &= ~(1 << SREG_I);
+}
+
+
+void can_emu_wdt_reset(void) {
+    fprintf(stderr, "can_emu: watchdog reset requested\n");
+    abort();
+}
+
+
+void can_emu_reset(void) {
+    memset(&can_emu, 0, sizeof(can_emu));
+    can_emu.mcusr = 1 << PORF;
+    can_emu.sreg = 1 << SREG_I;
+}
+
+
+uint8_t can_emu_irq_pending(void) {
+    if (!(can_emu.cangie & (1 << ENIT)))
+        return 0;
+    if (((can_emu.cangit & (1 << BOFFIT)) && (can_emu.cangie & (1 << ENBOFF)))
+        || ((can_emu.cangit & (1 << OVRTIM)) && (can_emu.cangie & (1 << ENOVRT)))
+        || ((can_emu.cangit & (1 << BXOK)) && (can_emu.cangie & (1 << ENBX)))
+        || ((can_emu.cangit & 0x0f) && (can_emu.cangie & (1 << ENERG))))
+        return 1;
+    uint8_t hpmob = can_emu_hpmob();
+    if (hpmob == 0xf0)
+        return 0;
+    uint8_t canstmob = can_emu.mob[hpmob >> 4].canstmob;
+    if ((canstmob & (1 << RXOK)) && (can_emu.cangie & (1 << ENRX)))
+        return 1;
+    if ((canstmob & (1 << TXOK)) && (can_emu.cangie & (1 << ENTX)))
+        return 1;
+    if ((canstmob & 0x1f) && (can_emu.cangie & (1 << ENERR)))
+        return 1;
+    return 0;
+}
+
+
+void can_emu_service(void) {
+    uint8_t nested = 0;
+    while ((can_emu.sreg & (1 << SREG_I)) && can_emu_irq_pending()) {
+        if (++nested > CAN_EMU_MAX_NESTED_IRQ) {
+            fprintf(stderr, "can_emu: CAN_INT_vect does not acknowledge MOb %u\n", can_emu_hpmob() >> 4);
+            abort();
+        }
+        // CANGIT is write one to clear, the model clears the flags pending on the entry
+        uint8_t cangit = can_emu.cangit;
+        can_emu.sreg &= ~(1 << SREG_I);
+        can_emu_can_int_vect();
+        can_emu.sreg |= 1 << SREG_I;
+        can_emu.cangit &= ~cangit;
+    }
+    // EE_READY_vect runs once per written byte, each write completes at once
+    uint16_t ee_ready = 0;
+    while ((can_emu.sreg & (1 << SREG_I)) && (*can_emu_eecr() & (1 << EERIE))) {
+        if (++ee_ready > CAN_EMU_EEPROM_SIZE) {
+            fprintf(stderr, "can_emu: EE_READY_vect does not clear EERIE\n");
+            abort();
+        }
+        can_emu.sreg &= ~(1 << SREG_I);
+        can_emu_ee_ready_vect();
+        can_emu.sreg |= 1 << SREG_I;
+    }
+}
+
+
+static uint8_t mob_accepts(const struct can_emu_mob *mob, const struct can_emu_frame *frame) {
+    if ((mob->cancdmob & ((1 << CONMOB1) | (1 << CONMOB0))) != (1 << CONMOB1))
+        return 0;
+    if (mob->canstmob & (1 << RXOK))
+        return 0;
+    return ((mob->canidt1 ^ frame->canidt1) & mob->canidm1) == 0
+           && ((mob->canidt2 ^ frame->canidt2) & mob->canidm2) == 0
+           && ((mob->canidt3 ^ frame->canidt3) & mob->canidm3) == 0
+           && ((mob->canidt4 ^ frame->canidt4) & mob->canidm4 & 0xf8) == 0;
+}
+
+
+uint8_t can_emu_receive(const struct can_emu_frame *frame) {
+    for (uint8_t i = 0; i < CAN_EMU_MOB_COUNT; ++i) {
+        struct can_emu_mob *mob = &can_emu.mob[i];
+        if (mob_accepts(mob, frame)) {
+            mob->canidt1 = frame->canidt1;
+            mob->canidt2 = frame->canidt2;
+            mob->canidt3 = frame->canidt3;
+            mob->canidt4 = frame->canidt4;
+            mob->cancdmob = (mob->cancdmob & 0xf0) | (frame->dlc & 0x0f);
+            memcpy(mob->msg, frame->data, sizeof(mob->msg));
+            mob->canstm = can_emu.cantim++;
+            mob->canstmob |= 1 << RXOK;
+            can_emu_service();
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+void can_emu_general_irq(uint8_t cangit) {
+    can_emu.cangit |= cangit & 0x7f;
+    can_emu_service();
+}
+
+
+uint8_t can_emu_transmit(struct can_emu_frame *frame) {
+    for (uint8_t i = 0; i < CAN_EMU_MOB_COUNT; ++i) {
+        struct can_emu_mob *mob = &can_emu.mob[i];
+        if ((mob->cancdmob & ((1 << CONMOB1) | (1 << CONMOB0))) == (1 << CONMOB0)
+            && !(mob->canstmob & (1 << TXOK))) {
+            frame->canidt1 = mob->canidt1;
+            frame->canidt2 = mob->canidt2;
+            frame->canidt3 = mob->canidt3;
+            frame->canidt4 = mob->canidt4;
+            frame->dlc = mob->cancdmob & 0x0f;
+            memcpy(frame->data, mob->msg, sizeof(frame->data));
+            mob->canstm = can_emu.cantim++;
+            mob->canstmob |= 1 << TXOK;
+            can_emu_service();
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+uint8_t can_emu_transmit_error(uint8_t errors) {
+    for (uint8_t i = 0; i < CAN_EMU_MOB_COUNT; ++i) {
+        struct can_emu_mob *mob = &can_emu.mob[i];
+        if ((mob->cancdmob & ((1 << CONMOB1) | (1 << CONMOB0))) == (1 << CONMOB0)
+            && !(mob->canstmob & (1 << TXOK))) {
+            mob->canstmob |= errors & 0x1f;
+            can_emu_service();
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+void can_emu_frame_set_id(struct can_emu_frame *frame, uint8_t priority, uint8_t type, uint8_t seqnum, uint16_t destination_id, uint16_t source_id) {
+    frame->canidt1 = ((priority << 7) & 0x80) | ((type << 2) & 0x7c) | ((seqnum >> 3) & 0x03);
+    frame->canidt2 = ((seqnum << 5) & 0xe0) | ((destination_id >> 4) & 0x1f);
+    frame->canidt3 = ((destination_id << 4) & 0xf0) | ((source_id >> 5) & 0x0f);
+    frame->canidt4 = ((source_id << 3) & 0xf8);
+}
@@ -0,0 +1,127 @@
+// SPDX-License-Identifier: MIT
+/*
+ * H9 CAN host build - emulated AVR CAN controller
+ *
+ * Copyright (C) 2024 Kamil Pałkowski
+ *
+ */
+
+#ifndef _CAN_EMU_H_
+#define _CAN_EMU_H_
+
+#include <stdint.h>
+
+#define CAN_EMU_MOB_COUNT 6
+#define CAN_EMU_EEPROM_SIZE 2048
+
+struct can_emu_mob {
+    uint8_t canstmob;
+    uint8_t cancdmob;
+    uint8_t canidt1;
+    uint8_t canidt2;
+    uint8_t canidt3;
+    uint8_t canidt4;
+    uint8_t canidm1;
+    uint8_t canidm2;
+    uint8_t canidm3;
+    uint8_t canidm4;
+    uint16_t canstm;
+    uint8_t msg[8];
+};
+
+struct can_emu {
+    uint8_t sreg;
+    uint8_t mcusr;
+    uint8_t cangcon;
+    uint8_t cangsta;
+    uint8_t cangit;
+    uint8_t cangie;
+    uint8_t canie2;
+    uint8_t cansit2;
+    uint8_t canbt1;
+    uint8_t canbt2;
+    uint8_t canbt3;
+    uint8_t cantcon;
+    uint16_t cantim;
+    uint8_t cantec;
+    uint8_t canrec;
+    uint8_t canpage;
+    uint16_t swres_count;
+    struct can_emu_mob mob[CAN_EMU_MOB_COUNT];
+    uint8_t eecr;
+    uint8_t eedr;
+    uintptr_t eear; // EEPROM address up to E2END, any other is host memory (see <avr/eeprom.h>)
+    uint8_t eeprom[CAN_EMU_EEPROM_SIZE];
+};
+
+struct can_emu_frame {
+    uint8_t canidt1;
+    uint8_t canidt2;
+    uint8_t canidt3;
+    uint8_t canidt4;
+    uint8_t dlc;
+    uint8_t data[8];
+};
+
+extern struct can_emu can_emu;
+
+/* register access helpers used by the <avr/io.h> shim */
+struct can_emu_mob *can_emu_page_mob(void);
+uint8_t *can_emu_msg(void);
+uint8_t can_emu_hpmob(void);
+uint8_t can_emu_en2(void);
+void can_emu_sei(void);
+void can_emu_cli(void);
+void can_emu_wdt_reset(void);
+uint8_t *can_emu_eecr(void);
+uint8_t *can_emu_eedr(void);
+uint8_t *can_emu_cangie(void);
+uint8_t *can_emu_cangcon(void);
+
+/* bus model */
+void can_emu_reset(void);
+
+/**
+ * @retval 1 - a MOb waits for CAN_INT_vect and the interrupt is enabled in CANGIE/CANIE2
+ */
+uint8_t can_emu_irq_pending(void);
+
+/**
+ * Runs CAN_INT_vect while an interrupt is pending and SREG_I is set, then EE_READY_vect while EERIE is set.
+ */
+void can_emu_service(void);
+
+/**
+ * Delivers a frame from the bus to the first enabled rx MOb whose filter accepts it.
+ * @retval 0 - frame dropped, no matching MOb
+ * @retval 1 - frame stored in MOb
+ */
+uint8_t can_emu_receive(const struct can_emu_frame *frame);
+
+/**
+ * Raises the CANGIT flags (bus off, timer overflow, general errors); set CANGSTA, CANTEC and CANREC first.
+ */
+void can_emu_general_irq(uint8_t cangit);
+
+/**
+ * Takes the frame of the highest priority pending tx MOb off the bus.
+ * @retval 0 - nothing to send
+ * @retval 1 - frame sent
+ */
+uint8_t can_emu_transmit(struct can_emu_frame *frame);
+
+/**
+ * The highest priority pending tx MOb fails with the CANSTMOB error bits, the controller would retry it.
+ * @retval 0 - nothing to send
+ * @retval 1 - error raised
+ */
+uint8_t can_emu_transmit_error(uint8_t errors);
+
+void can_emu_frame_set_id(struct can_emu_frame *frame, uint8_t priority, uint8_t type, uint8_t seqnum, uint16_t destination_id, uint16_t source_id);
+
+/* CAN_INT_vect handler defined by the code under test */
+void can_emu_can_int_vect(void);
+/* EE_READY_vect handler, the default one only clears EERIE */
+void can_emu_ee_ready_vect(void);
+
+#endif //_CAN_EMU_H_
@@ -0,0 +1,43 @@
+// SPDX-License-Identifier: MIT
+/*
+ * H9 CAN host build - <avr/eeprom.h> replacement, the EEPROM is plain host memory,
+ * fixed addresses (up to E2END) go to the emulated EEPROM
+ *
+ * Copyright (C) 2024 Kamil Pałkowski
+ *
+ */
+
+#ifndef _H9CAN_HOST_AVR_EEPROM_H_
+#define _H9CAN_HOST_AVR_EEPROM_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include <avr/io.h>
+
+#define EEMEM
+
+#define eeprom_busy_wait()
+
+static inline void *eeprom_host_address(const void *p) {
+    if ((uintptr_t)p <= E2END)
+        return &can_emu.eeprom[(uintptr_t)p];
+    return (void *)p;
+}
+
+static inline uint16_t eeprom_read_word(const uint16_t *p) {
+    uint16_t value;
+    memcpy(&value, eeprom_host_address(p), sizeof(value));
+    return value;
+}
+
+static inline void eeprom_write_word(uint16_t *p, uint16_t value) {
+    memcpy(eeprom_host_address(p), &value, sizeof(value));
+}
+
+static inline void eeprom_update_word(uint16_t *p, uint16_t value) {
+    if (eeprom_read_word(p) != value)
+        eeprom_write_word(p, value);
+}
+
+#endif //_H9CAN_HOST_AVR_EEPROM_H_
@@ -0,0 +1,22 @@
+// SPDX-License-Identifier: MIT
+/*
+ * H9 CAN host build - <avr/interrupt.h> replacement
+ *
+ * Copyright (C) 2024 Kamil Pałkowski
+ *
+ */
+
+#ifndef _H9CAN_HOST_AVR_INTERRUPT_H_
+#define _H9CAN_HOST_AVR_INTERRUPT_H_
+
+#include "can_emu.h"
+
+#define sei() can_emu_sei()
+#define cli() can_emu_cli()
+
+#define ISR(vector, ...) void vector(void)
+
+#define CAN_INT_vect can_emu_can_int_vect
+#define EE_READY_vect can_emu_ee_ready_vect
+
+#endif //_H9CAN_HOST_AVR_INTERRUPT_H_
@@ -0,0 +1,151 @@
+// SPDX-License-Identifier: MIT
+/*
+ * H9 CAN host build - <avr/io.h> replacement backed by the emulated CAN controller
+ *
+ * Copyright (C) 2024 Kamil Pałkowski
+ *
+ */
+
+#ifndef _H9CAN_HOST_AVR_IO_H_
+#define _H9CAN_HOST_AVR_IO_H_
+
+#include <stdint.h>
+
+#include "can_emu.h"
+
+// the emulated part
+#ifndef __AVR_ATmega64M1__
+#define __AVR_ATmega64M1__ 1
+#endif
+
+#define E2END (CAN_EMU_EEPROM_SIZE - 1)
+
+#define SREG can_emu.sreg
+#define SREG_I 7
+
+#define MCUSR can_emu.mcusr
+#define PORF 0
+#define EXTRF 1
+#define BORF 2
+#define WDRF 3
+
+// a started EEPROM read or write completes on the next EECR/EEDR access
+#define EECR (*can_emu_eecr())
+#define EERIE 3
+#define EEMPE 2
+#define EEPE 1
+#define EERE 0
+#define EEDR (*can_emu_eedr())
+#define EEAR can_emu.eear
+
+// SWRES takes effect on the next CANGCON access: CANGSTA, CANGIT, CANTEC, CANREC and CANTIM cleared
+#define CANGCON (*can_emu_cangcon())
+#define ABRQ 7
+#define OVRQ 6
+#define TTC 5
+#define SYNTTC 4
+#define LISTEN 3
+#define TEST 2
+#define ENASTB 1
+#define SWRES 0
+
+#define CANGSTA can_emu.cangsta
+#define OVFG 6
+#define TXBSY 4
+#define RXBSY 3
+#define ENFG 2
+#define BOFF 1
+#define ERRP 0
+
+#define CANGIT can_emu.cangit
+#define CANIT 7
+#define BOFFIT 6
+#define OVRTIM 5
+#define BXOK 4
+#define SERG 3
+#define CERG 2
+#define FERG 1
+#define AERG 0
+
+// an interrupt that got pending while ENIT was clear comes on the CANGIE access after the one setting ENIT again
+#define CANGIE (*can_emu_cangie())
+#define ENIT 7
+#define ENBOFF 6
+#define ENRX 5
+#define ENTX 4
+#define ENERR 3
+#define ENBX 2
+#define ENERG 1
+#define ENOVRT 0
+
+#define CANEN2 (can_emu_en2())
+#define ENMOB5 5
+#define ENMOB4 4
+#define ENMOB3 3
+#define ENMOB2 2
+#define ENMOB1 1
+#define ENMOB0 0
+
+#define CANIE2 can_emu.canie2
+#define IEMOB5 5
+#define IEMOB4 4
+#define IEMOB3 3
+#define IEMOB2 2
+#define IEMOB1 1
+#define IEMOB0 0
+
+#define CANSIT2 can_emu.cansit2
+
+#define CANBT1 can_emu.canbt1
+#define CANBT2 can_emu.canbt2
+#define CANBT3 can_emu.canbt3
+#define SMP 0
+
+#define CANTCON can_emu.cantcon
+#define CANTIM can_emu.cantim
+#define CANTEC can_emu.cantec
+#define CANREC can_emu.canrec
+
+#define CANHPMOB (can_emu_hpmob())
+
+#define CANPAGE can_emu.canpage
+#define MOBNB0 4
+#define AINC 3
+#define INDX0 0
+
+#define CANSTMOB (can_emu_page_mob()->canstmob)
+#define DLCW 7
+#define TXOK 6
+#define RXOK 5
+#define BERR 4
+#define SERR 3
+#define CERR 2
+#define FERR 1
+#define AERR 0
+
+#define CANCDMOB (can_emu_page_mob()->cancdmob)
+#define CONMOB1 7
+#define CONMOB0 6
+#define RPLV 5
+#define IDE 4
+#define DLC0 0
+
+#define CANIDT1 (can_emu_page_mob()->canidt1)
+#define CANIDT2 (can_emu_page_mob()->canidt2)
+#define CANIDT3 (can_emu_page_mob()->canidt3)
+#define CANIDT4 (can_emu_page_mob()->canidt4)
+#define RTRTAG 2
+#define RB0TAG 0
+
+#define CANIDM1 (can_emu_page_mob()->canidm1)
+#define CANIDM2 (can_emu_page_mob()->canidm2)
+#define CANIDM3 (can_emu_page_mob()->canidm3)
+#define CANIDM4 (can_emu_page_mob()->canidm4)
+#define RTRMSK 2
+#define IDEMSK 0
+
+#define CANSTM (can_emu_page_mob()->canstm)
+
+#define CANMSG (*can_emu_msg())
+
+#endif //_H9CAN_HOST_AVR_IO_H_
@@ -0,0 +1,22 @@
+// SPDX-License-Identifier: MIT
+/*
+ * H9 CAN host build - <avr/pgmspace.h> replacement, the flash is plain host memory
+ *
+ * Copyright (C) 2024 Kamil Pałkowski
+ *
+ */
+
+#ifndef _H9CAN_HOST_AVR_PGMSPACE_H_
+#define _H9CAN_HOST_AVR_PGMSPACE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define pgm_read_word(address) (*(const uint16_t *)(address))
+
+#define memcpy_P memcpy
+
+#endif //_H9CAN_HOST_AVR_PGMSPACE_H_
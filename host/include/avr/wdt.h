@@ -0,0 +1,21 @@
+// SPDX-License-Identifier: MIT
+/*
+ * H9 CAN host build - <avr/wdt.h> replacement
+ *
+ * Copyright (C) 2024 Kamil Pałkowski
+ *
+ */
+
+#ifndef _H9CAN_HOST_AVR_WDT_H_
+#define _H9CAN_HOST_AVR_WDT_H_
+
+#include "can_emu.h"
+
+#define WDTO_15MS 0
+#define WDTO_2S 7
+
+#define wdt_enable(timeout) can_emu_wdt_reset()
+#define wdt_disable() do { } while (0)
+#define wdt_reset() do { } while (0)
+
+#endif //_H9CAN_HOST_AVR_WDT_H_
@@ -11,19 +11,61 @@
 
 #include <avr/io.h>
 #include <avr/eeprom.h>
+#include <avr/pgmspace.h>
 #include "h9msg.h"
 
 extern volatile uint16_t can_node_id;
 
+typedef struct {
+    uint16_t rx_frames;         // saturates
+    uint16_t rx_overruns;       // rx ring full, the frame is dropped; saturates
+    uint16_t tx_frames;         // saturates
+    uint16_t tx_drops;          // CAN_put_msg found the tx queue full or the frame was given up on the bus; saturates
+    uint8_t rx_high_water;      // most bytes waiting in the rx ring
+    uint8_t tx_high_water;      // most bytes waiting in a tx queue for a free MOb
+    uint16_t error_interrupts;  // MOb and general errors, bus off included; saturates
+    uint16_t bit_errors;        // the error counters below saturate
+    uint16_t stuff_errors;
+    uint16_t crc_errors;
+    uint16_t form_errors;
+    uint16_t ack_errors;
+    uint16_t bus_offs;
+    uint8_t tec;                // CANTEC, CANREC and CAN_ERROR_* at the CAN_get_stats call
+    uint8_t rec;
+    uint8_t error_state;
+    uint16_t rx_unhandled;      // frames for the application CAN_dispatch had no handler for; saturates
+} can_stats_t;
+
+#define CAN_ERROR_PASSIVE 0x01
+#define CAN_ERROR_BUS_OFF 0x02
+#define CAN_ERROR_TX_HELD 0x04 // bus-off backoff, the tx MObs wait
+
 void CAN_init(uint16_t node_type, char hardware_rev, uint16_t version_major, uint16_t version_minor, const char *build_info);
 void CAN_send_turned_on_broadcast(void);
 
+// MOb3-5 transmit until taken for rx by CAN_set_mob_for_remote_node1..3 or CAN_subscribe
 void CAN_set_mob_for_remote_node1(uint16_t remote_node_id, uint8_t all_msg_group);
 void CAN_set_mob_for_remote_node2(uint16_t remote_node_id, uint8_t all_msg_group);
 void CAN_set_mob_for_remote_node3(uint16_t remote_node_id, uint8_t all_msg_group);
 
+typedef struct {
+    uint16_t source_id;
+    uint8_t all_msg_group; // as in CAN_set_mob_for_remote_node1..3
+} can_subscription_t;
+
+/**
+ * Frames of any number of remote nodes through up to max_mobs of MOb3-5, the others go back to transmit.
+ * Sources that share id bits are merged into one acceptance filter. Whatever the filters let through beyond
+ * the list CAN_get_msg/CAN_dispatch drop in software, the list has to stay valid until the next call.
+ * Replaces the CAN_set_mob_for_remote_node1..3 settings, count 0 releases all three MObs.
+ * @return number of (source id, type) pairs the filters accept beyond the list, 0 - exact hardware filtering
+ */
+uint16_t CAN_subscribe(const can_subscription_t *list, uint8_t count, uint8_t max_mobs);
+
 
 /**
+ * Frames are queued per priority, H9MSG_PRIORITY_HIGH ones overtake the queued low priority frames.
+ * Only the CAN interrupt is masked for a moment; call it from one context (not from other ISRs).
  * @retval 0 - FAIL - sanding in proggres and buffer is full
  * @retval 1 - OK
  * @retval 2 - added to buffer
@@ -37,6 +79,144 @@ uint8_t CAN_put_msg(h9msg_t *cm);
 uint8_t CAN_try_put_msg(h9msg_t *cm);
 uint8_t CAN_get_msg(h9msg_t*cm);
 
+/*
+ * Zero-copy receive: CAN_dispatch hands the frames CAN_get_msg would return to the handler in place in the
+ * rx ring, the CAN_frame_* accessors decode only the fields asked for. The driver's own frames it processes
+ * like CAN_get_msg. A frame is valid only inside the handler.
+ */
+typedef struct {
+    uint8_t head; // rx ring index of the frame
+} can_frame_t;
+
+/**
+ * @param kind - the CAN_get_msg return value: 1 - register/bit operation on the node, 2 - remote node frame
+ */
+typedef void (*can_frame_handler_t)(const can_frame_t *frame, uint8_t kind);
+
+void CAN_set_frame_handler(can_frame_handler_t handler);
+
+/**
+ * Without a handler the frames for the application are dropped and counted in rx_unhandled.
+ * @retval 0 - no frame received
+ * @retval 1 - one frame processed
+ */
+uint8_t CAN_dispatch(void);
+
+uint8_t CAN_frame_priority(const can_frame_t *frame);
+uint8_t CAN_frame_type(const can_frame_t *frame);
+uint8_t CAN_frame_seqnum(const can_frame_t *frame);
+uint16_t CAN_frame_destination_id(const can_frame_t *frame);
+uint16_t CAN_frame_source_id(const can_frame_t *frame);
+uint8_t CAN_frame_dlc(const can_frame_t *frame);
+uint8_t CAN_frame_data(const can_frame_t *frame, uint8_t idx);
+
+/*
+ * Zero-copy transmit: the payload goes straight into the tx queue of the reserved priority. Between
+ * CAN_reserve_* and CAN_commit_msg that queue takes no other frame: CAN_put_msg fails and another reservation
+ * too, the driver's own frames wait. Every reservation has to be committed.
+ */
+typedef struct {
+    uint8_t priority; // fixed by the reservation
+    uint8_t type;
+    uint8_t seqnum;
+    uint16_t destination_id;
+    uint8_t dlc;
+    uint8_t head; // tx ring index of the frame
+} can_tx_frame_t;
+
+/**
+ * Takes a new seqnum, type and destination_id are left for the caller.
+ * @retval 0 - FAIL - the queue is full
+ * @retval 1 - OK
+ */
+uint8_t CAN_reserve_msg(can_tx_frame_t *tx, uint8_t priority, uint8_t dlc);
+
+/**
+ * Addressed to the sender of req, with the response type as CAN_init_response_msg sets it.
+ * @retval 0 - FAIL - the queue is full
+ * @retval 1 - OK
+ */
+uint8_t CAN_reserve_response(const can_frame_t *req, can_tx_frame_t *tx, uint8_t dlc);
+void CAN_set_tx_frame_data(can_tx_frame_t *tx, uint8_t idx, uint8_t value);
+
+/**
+ * @retval 1 - OK
+ * @retval 2 - added to buffer
+ */
+uint8_t CAN_commit_msg(can_tx_frame_t *tx);
+
+#define CAN_FIRST_APP_REGISTER 10
+
+#define CAN_REG_READ 0x01
+#define CAN_REG_WRITE 0x02
+// the value in memory is a little-endian (AVR) integer, it goes most significant byte first
+#define CAN_REG_INT 0x04
+
+/*
+ * Application register descriptor. The value lives in memory at value or, when set, get/set produce
+ * and consume it in the bus byte order.
+ */
+typedef struct {
+    uint8_t size; // value bytes 1..H9MSG_MAX_REGISTER_SIZE, over 7 in segments; 0 - no such register
+    uint8_t flags;
+    void *value;
+    void (*get)(uint8_t reg, uint8_t *value);
+    uint8_t (*set)(uint8_t reg, const uint8_t *value); // @return 0 or H9FRAME_ERROR_*
+} can_reg_t;
+
+/**
+ * Entry i of the PROGMEM table describes register CAN_FIRST_APP_REGISTER + i. From then on the driver
+ * answers GET_REG, SET_REG and SET/CLEAR/TOGGLE_BIT (data[1] - bit number) itself, with the H9FRAME_ERROR_*
+ * replies, and CAN_get_msg/CAN_dispatch return 1 no more.
+ */
+void CAN_set_registers(const can_reg_t *table, uint8_t count);
+
+/*
+ * Bulk stream on the NODE_SPECIFIC_BULK types (see h9msg.h): in-order delivery with the receiver's credit
+ * flow control, go-back-N on a lost frame. One outgoing stream and one incoming stream at a time.
+ * The stream frames go low priority and always leave room in the tx queue for the register traffic,
+ * CAN_get_msg/CAN_dispatch keep the queue fed.
+ */
+#define CAN_BULK_CLOSED 0
+#define CAN_BULK_OPENING 1
+#define CAN_BULK_OPEN 2
+#define CAN_BULK_CLOSING 3
+
+/**
+ * Opens the stream to the node. The buffer (size up to 32768) keeps the written bytes until the receiver
+ * acknowledges them, it belongs to the stream until CAN_bulk_state returns CAN_BULK_CLOSED.
+ * @retval 0 - FAIL - a stream is already open
+ * @retval 1 - OK
+ */
+uint8_t CAN_bulk_open(uint16_t destination_id, uint8_t *buf, uint16_t size);
+
+/**
+ * Before the receiver accepts the stream too.
+ * @return bytes taken into the stream buffer, 0 - the buffer is full or the stream is not open
+ */
+uint16_t CAN_bulk_write(const uint8_t *data, uint16_t length);
+
+// bytes written and not acknowledged yet
+uint16_t CAN_bulk_pending(void);
+
+// closes the stream once the written bytes are acknowledged
+void CAN_bulk_close(void);
+
+// CAN_BULK_*, CAN_BULK_CLOSED also after the receiver refused, dropped or stopped answering the stream
+uint8_t CAN_bulk_state(void);
+
+/**
+ * Stream bytes in order, called from CAN_get_msg/CAN_dispatch.
+ * @param length - 1..8, 0 - the stream is closed
+ */
+typedef void (*can_bulk_handler_t)(uint16_t source_id, const uint8_t *data, uint8_t length);
+
+// accepts the streams of any node, one at a time, NULL refuses them
+void CAN_bulk_listen(can_bulk_handler_t handler);
+
+void CAN_get_stats(can_stats_t *stats);
+void CAN_clear_stats(void);
+
 void CAN_init_new_msg(h9msg_t *mes);
 void CAN_init_response_msg(const h9msg_t *req, h9msg_t *res);
 
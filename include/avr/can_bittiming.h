@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: MIT
+/*
+ * H9 CAN bit timing for AVR, CANBT1..3 values computed at compile time
+ *
+ * Copyright (C) 2024 Kamil Pałkowski
+ *
+ */
+
+#ifndef CAN_BITTIMING_H
+#define CAN_BITTIMING_H
+
+/*
+ * Inputs: F_CPU, CAN_BITRATE in bit/s, CAN_SAMPLE_POINT in percent of the bit, CAN_SJW in time quanta.
+ * The bit takes the fewest time quanta (8..25) that F_CPU divides into exactly with the prescaler 1..64 and that
+ * put the sample point within CAN_SAMPLE_POINT_TOLERANCE of the target. Phase segment 2 covers the rest of the
+ * bit after the sample point, at least the 2 quanta of the information processing time; phase segment 1 equals
+ * it and the propagation segment takes what is left, moving the excess over 8 quanta to phase segment 1.
+ * The defaults (125 kbit/s, 75 %) give the bit timing used by every h9 node so far.
+ */
+
+#ifndef CAN_BITRATE
+#define CAN_BITRATE 125000UL
+#endif
+
+#ifndef CAN_SAMPLE_POINT
+#define CAN_SAMPLE_POINT 75
+#endif
+
+#ifndef CAN_SAMPLE_POINT_TOLERANCE
+#define CAN_SAMPLE_POINT_TOLERANCE 5
+#endif
+
+#ifndef CAN_SJW
+#define CAN_SJW 1
+#endif
+
+#ifndef F_CPU
+#error "Please specify F_CPU"
+#endif
+
+// the timing of any bit rate, the ones below of CAN_BITRATE
+#define CAN_BT_PRESCALER_(bitrate, tq) (F_CPU / ((tq) * (bitrate)))
+#define CAN_BT_PHS2_ROUND_(tq) (((tq) * (100 - CAN_SAMPLE_POINT) + 50) / 100)
+#define CAN_BT_PHS2_(tq) (CAN_BT_PHS2_ROUND_(tq) < 2 ? 2 : CAN_BT_PHS2_ROUND_(tq))
+// propagation and phase 1 segments together
+#define CAN_BT_PRS_PHS1_(tq) ((tq) - 1 - CAN_BT_PHS2_(tq))
+#define CAN_BT_PHS1_(tq) (CAN_BT_PRS_PHS1_(tq) - CAN_BT_PHS2_(tq) > 8 ? CAN_BT_PRS_PHS1_(tq) - 8 \
+        : CAN_BT_PRS_PHS1_(tq) - CAN_BT_PHS2_(tq) < 1 ? CAN_BT_PRS_PHS1_(tq) - 1 : CAN_BT_PHS2_(tq))
+#define CAN_BT_PRS_(tq) (CAN_BT_PRS_PHS1_(tq) - CAN_BT_PHS1_(tq))
+
+#define CAN_BT_FITS_(bitrate, tq) (F_CPU % ((tq) * (bitrate)) == 0 \
+        && CAN_BT_PRESCALER_(bitrate, tq) >= 1 && CAN_BT_PRESCALER_(bitrate, tq) <= 64 \
+        && CAN_BT_PHS2_(tq) <= 8 && CAN_BT_PRS_PHS1_(tq) >= 2 && CAN_BT_PRS_PHS1_(tq) <= 16 \
+        && 100 * ((tq) - CAN_BT_PHS2_(tq)) >= (CAN_SAMPLE_POINT - CAN_SAMPLE_POINT_TOLERANCE) * (tq) \
+        && 100 * ((tq) - CAN_BT_PHS2_(tq)) <= (CAN_SAMPLE_POINT + CAN_SAMPLE_POINT_TOLERANCE) * (tq))
+
+// time quanta per bit, 0 - the bit rate is not reachable
+#define CAN_BT_TQ_(bitrate) (CAN_BT_FITS_(bitrate, 8) ? 8 \
+        : CAN_BT_FITS_(bitrate, 9) ? 9 \
+        : CAN_BT_FITS_(bitrate, 10) ? 10 \
+        : CAN_BT_FITS_(bitrate, 11) ? 11 \
+        : CAN_BT_FITS_(bitrate, 12) ? 12 \
+        : CAN_BT_FITS_(bitrate, 13) ? 13 \
+        : CAN_BT_FITS_(bitrate, 14) ? 14 \
+        : CAN_BT_FITS_(bitrate, 15) ? 15 \
+        : CAN_BT_FITS_(bitrate, 16) ? 16 \
+        : CAN_BT_FITS_(bitrate, 17) ? 17 \
+        : CAN_BT_FITS_(bitrate, 18) ? 18 \
+        : CAN_BT_FITS_(bitrate, 19) ? 19 \
+        : CAN_BT_FITS_(bitrate, 20) ? 20 \
+        : CAN_BT_FITS_(bitrate, 21) ? 21 \
+        : CAN_BT_FITS_(bitrate, 22) ? 22 \
+        : CAN_BT_FITS_(bitrate, 23) ? 23 \
+        : CAN_BT_FITS_(bitrate, 24) ? 24 \
+        : CAN_BT_FITS_(bitrate, 25) ? 25 \
+        : 0)
+
+#define CAN_BT1_(bitrate) ((CAN_BT_PRESCALER_(bitrate, CAN_BT_TQ_(bitrate)) - 1) << 1)
+#define CAN_BT2_(bitrate) (((CAN_SJW - 1) << 5) | ((CAN_BT_PRS_(CAN_BT_TQ_(bitrate)) - 1) << 1))
+// three samples (SMP) only with the prescaler, there is no time for them with one clock per quantum
+#define CAN_BT3_(bitrate) (((CAN_BT_PHS2_(CAN_BT_TQ_(bitrate)) - 1) << 4) | ((CAN_BT_PHS1_(CAN_BT_TQ_(bitrate)) - 1) << 1) \
+        | (CAN_BT_PRESCALER_(bitrate, CAN_BT_TQ_(bitrate)) > 1 ? 1 : 0))
+
+// a bit rate for CAN_BT1..3_() has to pass it
+#define CAN_BT_VALID_(bitrate) (CAN_BT_TQ_(bitrate) && CAN_SJW >= 1 && CAN_SJW <= 4 \
+        && CAN_SJW <= CAN_BT_PHS1_(CAN_BT_TQ_(bitrate)) && CAN_SJW <= CAN_BT_PHS2_(CAN_BT_TQ_(bitrate)))
+
+#if !CAN_BT_VALID_(CAN_BITRATE)
+#error "CAN_BITRATE with CAN_SAMPLE_POINT and CAN_SJW is not reachable from this F_CPU"
+#endif
+
+#define CAN_BT_TQ CAN_BT_TQ_(CAN_BITRATE)
+#define CAN_BT_PRESCALER CAN_BT_PRESCALER_(CAN_BITRATE, CAN_BT_TQ)
+#define CAN_BT_PHS1 CAN_BT_PHS1_(CAN_BT_TQ)
+#define CAN_BT_PHS2 CAN_BT_PHS2_(CAN_BT_TQ)
+#define CAN_BT_PRS CAN_BT_PRS_(CAN_BT_TQ)
+
+#define CAN_BT1_VALUE CAN_BT1_(CAN_BITRATE)
+#define CAN_BT2_VALUE CAN_BT2_(CAN_BITRATE)
+#define CAN_BT3_VALUE CAN_BT3_(CAN_BITRATE)
+
+#endif /* CAN_BITTIMING_H */
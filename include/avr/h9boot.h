@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: MIT
+/*
+ * H9 CAN - data shared by the AVR application and the bootloader
+ *
+ * Copyright (C) 2024 Kamil Pałkowski
+ *
+ */
+
+#ifndef H9BOOT_H
+#define H9BOOT_H
+
+#include <avr/io.h>
+
+// EEPROM words kept at the end of EEPROM, out of the way of the application EEMEM data
+#define H9BOOT_EE_NODE_TYPE ((uint16_t *)(E2END - 1))
+// application size in pages and CRC-16/XMODEM of them, stored by the bootloader after an upgrade
+#define H9BOOT_EE_APP_PAGES ((uint16_t *)(E2END - 3))
+#define H9BOOT_EE_APP_CRC ((uint16_t *)(E2END - 5))
+
+// written by the application right before it jumps to the bootloader, the bootloader latches it
+// into its .noinit in .init3, before the stack reaches the top of RAM
+#define H9BOOT_UPGRADE_REQUEST ((volatile uint16_t *)(RAMEND - 1))
+#define H9BOOT_UPGRADE_MAGIC 0xb007
+
+#endif //H9BOOT_H
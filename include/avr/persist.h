@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: MIT
+/*
+ * H9 CAN non-blocking EEPROM writes for AVR
+ *
+ * Copyright (C) 2024 Kamil Pałkowski
+ *
+ */
+
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include <stdint.h>
+
+// pending byte writes
+#define PERSIST_QUEUE_SIZE 8
+
+/*
+ * The bytes are queued and written one by one from EE_READY_vect, the caller returns at once. A byte queued
+ * again before it is written only gets the new value, a byte equal to the EEPROM content is not written at all.
+ * Call from one context (not from other ISRs); the EEPROM holds the old value until the write is done.
+ */
+
+/**
+ * @retval 0 - FAIL - the queue is full, nothing queued
+ * @retval 1 - OK
+ */
+uint8_t PERSIST_write_byte(uint8_t *address, uint8_t value);
+
+/**
+ * @retval 0 - FAIL - the queue is full, nothing queued
+ * @retval 1 - OK
+ */
+uint8_t PERSIST_write_word(uint16_t *address, uint16_t value);
+
+/**
+ * @retval 0 - FAIL - size over the free queue space, nothing queued
+ * @retval 1 - OK
+ */
+uint8_t PERSIST_write_block(void *address, const void *src, uint8_t size);
+
+/**
+ * @retval 1 - writes pending or in progress
+ */
+uint8_t PERSIST_busy(void);
+
+/**
+ * Blocks until every queued byte is written, works with the interrupts disabled too (before a reset).
+ */
+void PERSIST_flush(void);
+
+#endif /* PERSIST_H */
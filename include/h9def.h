@@ -38,6 +38,11 @@ enum {
 };
 
 enum {
+    // 11 bytes in segments: [0] TEC, [1] REC, [2] CAN_ERROR_* state bits (avr/can.h), [3] bus offs, [4..8] bit,
+    // stuff, CRC, form and ACK errors, [9] error interrupts, [10] frames CAN_dispatch had no handler for;
+    // the counters saturate at 0xff; SET_REG with any 1-byte value clears them together with the CAN stats.
+    // 1..9 are taken and 10 on belongs to the application (CAN_FIRST_APP_REGISTER), so this one is register 0
+    NODE_CAN_ERRORS_STD_REGISTER = 0,
     NODE_TYPE_STD_REGISTER = 1,
     NODE_HARDWARE_REVISION_STD_REGISTER,
     NODE_VERSION_STD_REGISTER,
@@ -46,6 +51,10 @@ enum {
     NODE_MCU_TYPE_STD_REGISTER,
     NODE_SN_STD_REGISTER,
     NODE_RESET_REASON_STD_REGISTER,
+    // REG_VALUE data[1..2] rx frames, data[3..4] tx frames (both saturate at 0xffff), data[5] rx overruns, data[6] tx
+    // queue full drops (both saturate at 0xff), data[7] bits 7..4 rx ring, bits 3..1 tx ring high-water mark, bit 0
+    // error seen (details in NODE_CAN_ERRORS_STD_REGISTER); SET_REG with any 1-byte value clears the counters
+    NODE_CAN_STATS_STD_REGISTER,
     NODE_STD_REGISTER_LAST
 };
 
@@ -56,6 +65,7 @@ enum {
   H9FRAME_ERROR_READ_ONLY_REGISTER = 4,
   H9FRAME_ERROR_WRITE_ONLY_REGISTER = 5,
   H9FRAME_ERROR_REGISTER_SIZE_MISMATCH = 6,
+  H9FRAME_ERROR_BUSY = 7,
   H9FRAME_ERROR_NODE_SPECIFIC_ERROR = 0xff,
 };
 
@@ -75,6 +75,58 @@
 #define H9MSG_TYPE_NODE_SPECIFIC_BULK6 30
 #define H9MSG_TYPE_NODE_SPECIFIC_BULK7 31
 
+// H9MSG_TYPE_PAGE_START: data[0..1] page number, optional data[2] transfer flags, data[3] flag dependent
+#define H9MSG_PAGE_START_FLAG_STREAM 0x01
+#define H9MSG_PAGE_START_FLAG_VERIFY 0x02
+// PackBits compressed page, data[3] number of PAGE_FILL frames
+#define H9MSG_PAGE_START_FLAG_COMPRESSED 0x04
+
+// H9MSG_TYPE_PAGE_WRITED: data[0..1] page address, data[2] result flags (only for H9MSG_PAGE_START_FLAG_VERIFY)
+#define H9MSG_PAGE_WRITED_FLAG_UNCHANGED 0x01
+
+// H9MSG_TYPE_NOP with dlc > 0: bootloader command in data[0], the node answers with NOP and the same command
+// H9MSG_BOOTLOADER_CMD_PAGE_CRC: data[1..2] first page, data[3..4] page count;
+//                                answer data[1..4] as requested, data[5..6] CRC-16/XMODEM of the pages
+#define H9MSG_BOOTLOADER_CMD_PAGE_CRC 1
+// H9MSG_BOOTLOADER_CMD_MULTICAST_JOIN (to H9MSG_BROADCAST_ID): data[1] NODE_MCU_*, data[2] NODE_MCU_F_*,
+//                                      data[3..4] node type (0 - any); matching nodes answer with data[0] only
+#define H9MSG_BOOTLOADER_CMD_MULTICAST_JOIN 2
+// H9MSG_BOOTLOADER_CMD_MULTICAST_END (to H9MSG_BROADCAST_ID): data[1..2] first page, data[3..4] page count;
+//                                     answer data[1..2] pages not received, data[3..4] first, data[5..6] last of them
+#define H9MSG_BOOTLOADER_CMD_MULTICAST_END 3
+// H9MSG_BOOTLOADER_CMD_BITRATE: data[1..2] bit rate in kbit/s; answer (still at the old rate) data[1..2] the rate the
+//                               node runs at from then on, its default one unless the requested rate is supported;
+//                               with no frame received for the bootloader timeout the node goes back to the default
+#define H9MSG_BOOTLOADER_CMD_BITRATE 4
+
+// H9MSG_TYPE_GET_REG with dlc 2..8: data[0..dlc-1] registers, answered one by one in that order as single GET_REGs
+// (REG_VALUE or ERROR with the same seqnum); a batch while the previous one is still answered gets
+// ERROR H9FRAME_ERROR_BUSY
+
+// register values longer than 7 bytes (up to H9MSG_MAX_REGISTER_SIZE) go as SET_REG, REG_VALUE or
+// REG_EXTERNALLY_CHANGED segments with the same seqnum: data[0] register, data[1] segment number
+// (H9MSG_SEGMENT_LAST set on the last one), data[2..7] up to H9MSG_SEGMENT_VALUE_SIZE value bytes
+#define H9MSG_SEGMENT_LAST 0x80
+#define H9MSG_SEGMENT_VALUE_SIZE 6
+
+// bulk stream from a sender to a receiver node, one stream per direction and node pair:
+// H9MSG_TYPE_NODE_SPECIFIC_BULK0 - control, data[0] operation below;
+// H9MSG_TYPE_NODE_SPECIFIC_BULK1..7 - data, 1..8 stream bytes, no header; the frame sequence number
+// (type - H9MSG_TYPE_NODE_SPECIFIC_BULK1) * 32 + seqnum runs modulo H9MSG_BULK_SEQ_MODULO from 0 on OPEN
+#define H9MSG_BULK_SEQ_MODULO 224
+// sender: a new stream, answered with CREDIT or CLOSED (refused)
+#define H9MSG_BULK_OPEN 1
+// receiver: data[1] next expected frame, data[2] window - frames the sender may send from it on
+#define H9MSG_BULK_CREDIT 2
+// receiver: as CREDIT, a frame is missing, the sender goes back to data[1]
+#define H9MSG_BULK_RESEND 3
+// sender: all frames sent wait for the acknowledgement, answered with CREDIT
+#define H9MSG_BULK_POLL 4
+// sender: data[1] the next frame number, the stream ends there; answered with CLOSED or RESEND
+#define H9MSG_BULK_CLOSE 5
+// receiver: the stream is closed or refused
+#define H9MSG_BULK_CLOSED 6
+
 
 // 31 30 29 | 28 27 26 25 24 23 22 21 | 20 19 18 17 16 15 14 13 | 12 11 10 09 08 07 06 05 | 04 03 02 01 00
 // -- -- -- | pp ty ty ty ty ty se se | se se se ds ds ds ds ds | ds ds ds ds so so so so | so so so so so
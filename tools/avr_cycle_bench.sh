@@ -0,0 +1,38 @@
+#!/bin/bash
+#
+# Runs the avr_bench firmware images under simavr and prints one tab separated table.
+#
+# usage: avr_cycle_bench.sh <avr build dir> <avr_cycle_bench binary>
+#
+# The images come from the h9can_bench target of an AVR build, the runner from the host build.
+#
+
+if [[ $# -ne 2 ]]; then
+  echo "usage: $0 <avr build dir> <avr_cycle_bench binary>" >&2
+  exit 1
+fi
+
+build_dir="$1"
+runner="$2"
+
+"${runner}" -H
+
+ret=0
+for elf in $(find "${build_dir}" -name 'h9can_bench_*.elf' | sort); do
+  name=$(basename "${elf}" .elf)
+  freq=${name##*_}
+  mmcu=${name%_*}
+  mmcu=${mmcu##*_}
+  fcpu=$(( ${freq%M} * 1000000 ))
+
+  "${runner}" -m "${mmcu}" -f "${fcpu}" "${elf}"
+  status=$?
+  if [[ ${status} -eq 2 ]]; then
+    echo "${name}: skipped, no simavr core" >&2
+  elif [[ ${status} -ne 0 ]]; then
+    echo "${name}: failed" >&2
+    ret=1
+  fi
+done
+
+exit ${ret}